@@ -133,12 +133,32 @@ int main() {
             break;
         } else if (strcmp(token, "mkfs") == 0) {
             char *fs_name = strtok(NULL, " ");
-            int blocks_in_fat = atoi(strtok(NULL, " "));
-            int block_size_config = atoi(strtok(NULL, " "));
-            mkfs(fs_name, blocks_in_fat, block_size_config);
+            int flags = 0;
+            // mkfs -32 FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG makes a FAT32 image
+            if (fs_name != NULL && strcmp(fs_name, "-32") == 0) {
+                flags |= MKFS_FAT32;
+                fs_name = strtok(NULL, " ");
+            }
+            char *blocks_arg = fs_name != NULL ? strtok(NULL, " ") : NULL;
+            char *config_arg = blocks_arg != NULL ? strtok(NULL, " ") : NULL;
+            if (config_arg == NULL) {
+                continue;
+            }
+            int blocks_in_fat = atoi(blocks_arg);
+            int block_size_config = atoi(config_arg);
+            mkfs_with_flags(fs_name, blocks_in_fat, block_size_config, flags);
         } else if (strcmp(token, "mount") == 0) {
             char *fs_name = strtok(NULL, " ");
-            mount(fs_name);
+            int flags = 0;
+            // mount -m FS_NAME maps the data region instead of caching it
+            if (fs_name != NULL && strcmp(fs_name, "-m") == 0) {
+                flags |= MOUNT_MMAP_DATA;
+                fs_name = strtok(NULL, " ");
+            }
+            if (fs_name == NULL) {
+                continue;
+            }
+            mount_with_flags(fs_name, flags);
         } else if (strcmp(token, "umount") == 0) {
             if (FS_NAME == NULL) {
                 continue;
@@ -216,6 +236,13 @@ int main() {
                 // write(1, "dest host\n", sizeof(char) * strlen("dest host\n"));
                 cp(arg1, arg3, 0, 1);
             }
+        } else if (strcmp(token, "defrag") == 0) {
+            if (FS_NAME == NULL) {
+                continue;
+            }
+            // defrag -c also compacts files toward the start of the image
+            char *arg = strtok(NULL, " ");
+            defrag(arg != NULL && strcmp(arg, "-c") == 0);
         } else if (strcmp(token, "ls") == 0) {
             if (FS_NAME == NULL) {
                 continue;
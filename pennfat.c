@@ -1,83 +1,362 @@
+#define _GNU_SOURCE // copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include "pennfat.h"
 
 #define MAX_FAT_ENTRIES 65534 // Maximum for FAT16
-DirectoryEntry* ROOT = NULL;
-FDTEntry** FDT = NULL;
-int BLOCKS_IN_FAT = 0;
-int BLOCK_SIZE = 0;
-int FAT_SIZE = 0;
-int NUM_FAT_ENTRIES = 0; 
-int TABLE_REGION_SIZE = 0;
-int DATA_REGION_SIZE = 0;
-int BLOCK_SIZE_CONFIG = 0;
-uint16_t *FAT_TABLE = 0;
-uint16_t *FAT_DATA = 0;
-char* FS_NAME = NULL;
+#define MAX_FAT32_BLOCKS_IN_FAT 0xFFFF // blocks_in_fat is stored in the upper 24 bits of a FAT32 header
+#define FAT32_HEADER_FLAG 0x80 // set in the block_size_config byte of FAT32 images
+#define COPY_CHUNK (64 * 1024) // bytes moved per read/write pair by pennfat_copy
+#define FDT_CHUNK 64 // descriptor entries allocated together in the FDT pool
+#define HOST_COPY_CHUNK (1 << 20) // bytes read from the host per f_write by cp -h
+#define DIRECT_READ_BYTES (64 * 1024) // reads at least this large copy whole blocks past the cache
+#define RA_MIN_BLOCKS 4 // first readahead window once reads look sequential
+#define RA_MAX_BLOCKS 64 // readahead window stops doubling here
+#define CAT_CHUNK (64 * 1024) // bytes in each half of cat's double buffer
+#define DIRECT_WRITE_BYTES (64 * 1024) // writes at least this large send whole blocks past the cache
+int CACHE_BLOCKS = 256;
+__thread int DIR_LOCK_DEPTH = 0;    // public calls call each other, so DIR_LOCK is taken once per thread
+                                    // (a thread is inside one file system at a time)
+__thread bool DIR_LOCK_EXCLUSIVE = false;
 
 // Helper functions
 int write_entry_to_root(DirectoryEntry* entry);
 int cp_from_h(const char *source, const char *dest);
 int cp_helper(const char *source, const char *dest);
 int cp_to_h(const char *source, const char *dest);
-int append_to_penn_fat(char* data, int block_no, int n, int size);
+int64_t host_copy_range(int out_fd, off_t out_off, int in_fd, off_t in_off, int64_t len);
+int64_t copy_file_runs(int first_block, int64_t size, int host_fd, bool to_host, int* last_block);
 int delete_from_penn_fat(const char *filename);
-int find_first_free_block();
+int alloc_block();
+int alloc_extent(int hint, int want, int* got);
+bool block_is_free(int block);
+void free_block(int block);
+void free_map_build();
+void free_map_destroy();
+void free_map_release(int block);
+void fat_dirty_init(bool private_map);
+void fat_dirty_destroy();
+int fat_flush_pages(int first_page, int last_page);
+int fat_flush();
+int fat_flush_entry(int block);
+int data_sync_run(int first_block, int count);
+int cache_write_back_run(int first_block, int count);
+int data_write_run(int first_block, int count, const char* buf);
+int data_read_run(int first_block, int count, char* buf);
+void journal_open(off_t offset, uint32_t next_seq);
+void journal_close();
+void journal_begin();
+void journal_close_op();
+void journal_commit();
+void journal_checkpoint();
+void journal_sync();
+int journal_apply(const char* buf, int len, uint32_t first_seq, bool replay);
+void journal_log_fat(int block, int value);
+void dir_write(int block, int slot, const DirectoryEntry* entry);
+void dir_apply(int block, uint32_t slot, const DirectoryEntry* entry);
 int add_entry_to_root(DirectoryEntry* entry);
 DirectoryEntry* delete_entry_from_root(const char *filename);
 DirectoryEntry* get_entry_from_root(const char *filename, bool update_first_block, char* rename_to);
-int strcat_data(char* data, int start_index);
+int fat_get(int block);
+void fat_set(int block, int value);
+int entry_first_block(const DirectoryEntry* entry);
+void set_entry_first_block(DirectoryEntry* entry, int block);
+int entry_tail_block(const DirectoryEntry* entry);
+void set_entry_tail(DirectoryEntry* entry, int block);
+void set_fat_geometry(int blocks_in_fat, int block_size_config, bool wide);
 int* get_fat_chain(int start_index);
+int fdt_grow();
+void fdt_destroy();
+void dir_lock(bool exclusive);
+void dir_lock_upgrade();
+void dir_unlock();
+// bodies of the public calls, run with DIR_LOCK held
+int touch_locked(const char *filename);
+int rm_locked(const char *filename);
+int mv_locked(const char *source, const char *dest);
+int cat_locked(const char **files, int num_files, const char *output_file, int append);
+void* cat_writer(void* arg);
+int f_open_locked(char *fname, int mode);
+int f_close_locked(int fd);
+int f_read_locked(int fd, int n, char *buf);
+int f_write_locked(int fd, const char *str, int n);
+int f_fallocate_locked(int fd, int len);
+int f_lseek_locked(int fd, int offset, int whence);
+int f_fsync_locked(int fd);
+int f_unlink_locked(const char *fname);
+int f_flush_locked(int fd);
+int fdt_write_through(int fd, const char *str, int n, int at);
+int fdt_writev_through(int fd, const struct iovec* iov, int iovcnt, int at);
+int f_pread_locked(int fd, int n, char *buf, int offset);
+int f_pwrite_locked(int fd, const char *str, int n, int offset);
+int f_readv_locked(int fd, const struct iovec *iov, int iovcnt);
+int f_writev_locked(int fd, const struct iovec *iov, int iovcnt);
+int fdt_flush(int fd);
+void fdt_flush_name(const char *fname);
+void fdt_drop_name(const char *fname);
+int fdt_flush_all();
+
+// In-memory index of the root directory, keyed by file name
+typedef struct RootIndexNode {
+    DirectoryEntry entry;           // copy of the on-disk entry
+    int block;                      // root block holding the entry
+    int slot;                       // index of the entry within that block
+    unsigned int chain_gen;         // changes whenever the FAT chain is dropped or replaced
+    int open_count;                 // descriptors open on the file under this name
+    pthread_rwlock_t lock;          // shared by readers of the file, exclusive for writers
+    struct RootIndexNode* next;     // next node in the same bucket
+} RootIndexNode;
+
+typedef struct {
+    int block;
+    int slot;
+} RootSlot;
+
+typedef struct {
+    RootIndexNode** buckets;
+    int num_buckets;                // always a power of two
+    int count;
+    RootSlot* free_slots;           // empty/deleted slots available for reuse
+    int num_free;
+    int cap_free;
+} RootIndex;
+
+
+// Free-block bitmap built at mount (bit set = block in use)
+typedef struct {
+    uint64_t* words;
+    int num_words;
+    int num_blocks;                 // blocks 0 .. num_blocks-1 are addressable
+    int cursor;                     // next-fit position, in blocks
+    int num_free;                   // running count of free data blocks
+} FreeMap;
+
+
+// Metadata journal kept in a region behind the data region. Each operation's FAT entry
+// and directory slot updates become one record; records are queued and written to the
+// log in batches with a single flush (group commit) and replayed at mount.
+// While journaling the FAT is mapped privately and only reaches the image at a checkpoint,
+// and directory slots are written home once the batch holding them is durable.
+#define JOURNAL_SIZE (1 << 20)              // bytes reserved behind the data region by mkfs
+#define JOURNAL_HEADER_SIZE 512             // header, then the log
+#define JOURNAL_MAGIC 0x4C4E524A            // "JRNL"
+#define JOURNAL_RECORD_MAGIC 0x4345524A     // "JREC"
+#define JOURNAL_BATCH_BYTES (64 * 1024)     // commit once this much is queued
+#define JOURNAL_BATCH_OPS 64                // or once this many operations are queued
+#define JOURNAL_CLEAR_BLOCK 0xFFFFFFFF      // directory record slot that zeroes the whole block
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                  // bytes in the journal region, header included
+    uint32_t next_seq;              // records below this sequence number are already checkpointed
+} JournalHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;                   // consecutive from the header's next_seq
+    uint32_t num_fats;              // JournalFat updates following the record header
+    uint32_t num_dirs;              // JournalDir updates following the FAT updates
+    uint32_t checksum;              // FNV-1a of the record with this field zeroed
+    uint32_t pad;
+} JournalRecord;
+
+typedef struct {
+    uint32_t block;
+    uint32_t value;                 // 0xFFFFFFFF = end of chain
+} JournalFat;
+
+typedef struct {
+    uint32_t block;
+    uint32_t slot;                  // JOURNAL_CLEAR_BLOCK = zero the whole block
+    DirectoryEntry entry;
+} JournalDir;
+
+typedef struct {
+    bool active;
+    off_t offset;                   // image offset of the journal region
+    int capacity;                   // bytes of log after the header
+    int head;                       // bytes of log written since the last checkpoint
+    uint32_t seq;                   // sequence number of the next record
+    JournalFat* fats;               // updates of the operation in progress
+    int num_fats;
+    int cap_fats;
+    JournalDir* dirs;
+    int num_dirs;
+    int cap_dirs;
+    char* batch;                    // closed records waiting for the group commit
+    int batch_len;
+    int batch_cap;
+    int batch_ops;
+} Journal;
+
+
+// FAT pages modified since they were last written to the image (bit set = dirty),
+// so syncs, checkpoints and umount only write what changed
+typedef struct {
+    uint64_t* words;
+    int num_pages;
+    int page_size;
+    bool private_map;               // FAT mapped MAP_PRIVATE: pages are written with pwrite, not msync
+} FatDirty;
+
+
+bool journal_read_header(int fs_fd, off_t offset, JournalHeader* header);
+uint32_t journal_checksum(const JournalRecord* record);
+
+// LRU cache of data/directory blocks with write-back of dirty blocks
+typedef struct CacheBlock {
+    int block;                      // block number held (0 = slot unused)
+    bool dirty;                     // modified since it was last written to the image
+    char* data;                     // BLOCK_SIZE bytes
+    struct CacheBlock* prev;        // LRU list, head is most recently used
+    struct CacheBlock* next;
+    struct CacheBlock* hash_next;   // next block in the same bucket
+} CacheBlock;
+
+typedef struct {
+    CacheBlock* slots;
+    int capacity;
+    char* arena;                    // capacity * BLOCK_SIZE bytes backing the slots
+    CacheBlock** buckets;
+    int num_buckets;                // power of two >= capacity
+    CacheBlock* lru_head;
+    CacheBlock* lru_tail;
+} BlockCache;
+
+// Per-mount state that is private to this file; the public part lives in pennfat_fs.
+// Locks for multithreaded callers are always taken in this order:
+// DIR_LOCK, a descriptor's lock, a file's lock, ALLOC_LOCK, CACHE_LOCK.
+// Per-descriptor calls (f_read, f_write, f_lseek, ...) hold DIR_LOCK shared; calls that change
+// the directory or the descriptor table or walk every file hold it exclusively and so run alone.
+struct pennfat_fs_state {
+    char* data_map;                 // page-aligned mapping holding FAT_DATA (MOUNT_MMAP_DATA)
+    size_t data_map_size;
+    RootIndex root_index;
+    unsigned int chain_gen;
+    FreeMap free_map;
+    Journal journal;
+    FatDirty fat_dirty;
+    BlockCache cache;
+    FDTEntry** fdt_pool;            // FDT_CHUNK entries per chunk; descriptor i always uses entry i
+    int* fdt_free;                  // stack of free descriptors, the lowest on top after each growth
+    int num_fdt_free;
+    pthread_rwlock_t dir_lock;
+    pthread_mutex_t alloc_lock;     // FAT, free map, journal, directory slot writes
+    pthread_mutex_t cache_lock;     // block cache
+};
+
+#define DATA_MAP (CURRENT_FS->state->data_map)
+#define DATA_MAP_SIZE (CURRENT_FS->state->data_map_size)
+#define ROOT_INDEX (CURRENT_FS->state->root_index)
+#define CHAIN_GEN (CURRENT_FS->state->chain_gen)
+#define FREE_MAP (CURRENT_FS->state->free_map)
+#define JOURNAL (CURRENT_FS->state->journal)
+#define FAT_DIRTY (CURRENT_FS->state->fat_dirty)
+#define CACHE (CURRENT_FS->state->cache)
+#define FDT_POOL (CURRENT_FS->state->fdt_pool)
+#define FDT_FREE (CURRENT_FS->state->fdt_free)
+#define NUM_FDT_FREE (CURRENT_FS->state->num_fdt_free)
+#define DIR_LOCK (CURRENT_FS->state->dir_lock)
+#define ALLOC_LOCK (CURRENT_FS->state->alloc_lock)
+#define CACHE_LOCK (CURRENT_FS->state->cache_lock)
+
+// the file system used by the calls that take no handle, unless a thread picks another
+struct pennfat_fs_state DEFAULT_STATE = {
+    .dir_lock = PTHREAD_RWLOCK_INITIALIZER,
+    .alloc_lock = PTHREAD_MUTEX_INITIALIZER,
+    .cache_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+pennfat_fs DEFAULT_FS = {
+    .fat_entry_size = 2,
+    .fs_fd = -1,
+    .state = &DEFAULT_STATE,
+};
+__thread pennfat_fs* CURRENT_FS = &DEFAULT_FS;
+
+off_t data_block_offset(int block);
+char* block_data(int block);
+void cache_init();
+void cache_destroy();
+CacheBlock* cache_find(int block);
+CacheBlock* cache_evict();
+void cache_insert(CacheBlock* cb, int block);
+CacheBlock* cache_lookup(int block, bool will_overwrite);
+int cache_prefetch_run(int first_block, int count);
+int cache_read(int block, int offset, char* buf, int n);
+int cache_write(int block, int offset, const char* buf, int n);
+int cache_write_fresh(int block, const char* buf, int n);
+void cache_drop(int block);
+void cache_unlink_lru(CacheBlock* cb);
+void cache_push_front(CacheBlock* cb);
+void cache_unhash(CacheBlock* cb);
+int cache_write_back(CacheBlock* cb);
+
+unsigned int root_index_hash(const char *filename);
+void root_index_grow();
+void root_index_build();
+void root_index_destroy();
+RootIndexNode* root_index_find(const char *filename);
+RootIndexNode* root_index_insert(const DirectoryEntry* entry, int block, int slot);
+void root_index_remove(RootIndexNode* node);
+void root_index_push_free(int block, int slot);
+bool root_index_pop_free(int* block, int* slot);
+int chain_block_at(RootIndexNode* node, FDTEntry* fdt, int index, int extend);
+void chain_build_map(RootIndexNode* node, FDTEntry* fdt);
+void chain_reset_cursor(FDTEntry* fdt);
+int read_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, char* buf, int n);
+void fdt_readahead(RootIndexNode* node, FDTEntry* fdt, int offset, int n);
+int write_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const char* buf, int n);
+int fill_hole(RootIndexNode* node, FDTEntry* fdt, int offset);
+int iov_slice(const struct iovec* iov, int iovcnt, size_t skip, size_t len, struct iovec* out);
+int iov_total(const struct iovec* iov, int iovcnt);
+int vec_transfer(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total,
+                 bool write, int* last_block);
+int readv_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total);
+int writev_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total);
+int truncate_file(RootIndexNode* node);
+int chain_runs(int first_block, int* num_blocks);
+int relocate_chain(RootIndexNode* node, bool compact);
 
 
 void mkfs(char *fs_name, int blocks_in_fat, int block_size_config) {
-    BLOCKS_IN_FAT = blocks_in_fat;
+    mkfs_with_flags(fs_name, blocks_in_fat, block_size_config, 0);
+}
+
+void mkfs_with_flags(char *fs_name, int blocks_in_fat, int block_size_config, int flags) {
+    bool wide = flags & MKFS_FAT32;
+    int max_blocks_in_fat = wide ? MAX_FAT32_BLOCKS_IN_FAT : 32;
+    if (blocks_in_fat < 1 || blocks_in_fat > max_blocks_in_fat || block_size_config < 0 || block_size_config > 4) {
+        fprintf(stderr, "Error: invalid PennFAT geometry (%d FAT blocks, block size config %d)\n", blocks_in_fat, block_size_config);
+        return;
+    }
+
+    // the image is laid out in a scratch file system so the current mount's geometry is untouched
+    struct pennfat_fs_state scratch_state = {0};
+    pennfat_fs scratch = {.fs_fd = -1, .state = &scratch_state};
+    pennfat_fs* prev = pennfat_use(&scratch);
+
     int fs_fd = open(fs_name, O_RDWR | O_CREAT, 0666);
     if (fs_fd == -1) {
         perror("Error creating file system image");
         exit(1);
     }
-
-    switch(block_size_config) {
-        case 0:
-            BLOCK_SIZE = 256;
-            break;
-        case 1:
-            BLOCK_SIZE = 512;
-            break;
-        case 2:
-            BLOCK_SIZE = 1024;
-            break;
-        case 3:
-            BLOCK_SIZE = 2048;
-            break;
-        case 4:
-            BLOCK_SIZE = 4096;
-            break;
-    }
     // FS_NAME = malloc(sizeof(char) * (strlen(fs_name)+1));
     // strcpy(FS_NAME, fs_name); // save name
 
     // Calculate FAT and file system size
-    BLOCK_SIZE_CONFIG = block_size_config;
-    FAT_SIZE = BLOCK_SIZE * blocks_in_fat;
-    NUM_FAT_ENTRIES = (BLOCK_SIZE * blocks_in_fat) / 2;
-    TABLE_REGION_SIZE = sizeof(uint16_t) * NUM_FAT_ENTRIES;
-    if (BLOCK_SIZE == 4096 && BLOCKS_IN_FAT == 32) {
-        DATA_REGION_SIZE = BLOCK_SIZE * (NUM_FAT_ENTRIES - 2);
-    } else {
-        DATA_REGION_SIZE = BLOCK_SIZE * (NUM_FAT_ENTRIES - 1);
-    }
-    
+    set_fat_geometry(blocks_in_fat, block_size_config, wide);
 
-    // Set the file system size
-    if (ftruncate(fs_fd, FAT_SIZE + DATA_REGION_SIZE) == -1) {
+    // Set the file system size (the metadata journal sits behind the data region)
+    if (ftruncate(fs_fd, FAT_SIZE + DATA_REGION_SIZE + JOURNAL_SIZE) == -1) {
         perror("Error setting file system size");
         close(fs_fd);
         exit(1);
@@ -94,26 +373,64 @@ void mkfs(char *fs_name, int blocks_in_fat, int block_size_config) {
     //     exit(1);
     // }
 
-    // allocate space for fat table
+    // allocate space for fat table (calloc leaves every other entry free)
     FAT_TABLE = calloc(1, FAT_SIZE);
 
     // Initialize the FAT_TABLE
-    FAT_TABLE[0] = (BLOCKS_IN_FAT << 8) | BLOCK_SIZE_CONFIG; //MSB = blocks_in_fat, LSB = block_size_config
+    if (wide) {
+        // upper 24 bits = blocks_in_fat, low byte = block_size_config | FAT32_HEADER_FLAG
+        ((uint32_t*) FAT_TABLE)[0] = ((uint32_t) BLOCKS_IN_FAT << 8) | FAT32_HEADER_FLAG | BLOCK_SIZE_CONFIG;
+    } else {
+        FAT_TABLE[0] = (BLOCKS_IN_FAT << 8) | BLOCK_SIZE_CONFIG; //MSB = blocks_in_fat, LSB = block_size_config
+    }
     // Initialize the root directory
-    FAT_TABLE[1] = 0xFFFF; // First block of root directory is FFFF to signal it's the end
+    fat_set(1, FAT_END); // First block of root directory is the end of its chain
 
-    for (int i = 2; i < NUM_FAT_ENTRIES; i++) {
-        FAT_TABLE[i] = 0;
-    }
-    
     write(fs_fd, FAT_TABLE, FAT_SIZE);
-    
+
+    // an image being reformatted must not keep its old root directory
+    char* zeros = calloc(1, BLOCK_SIZE);
+    pwrite(fs_fd, zeros, BLOCK_SIZE, TABLE_REGION_SIZE);
+    free(zeros);
+
+    // empty journal: the first record slot is zeroed too, so a reformatted image
+    // never replays the log of its previous life
+    char header[JOURNAL_HEADER_SIZE + sizeof(JournalRecord)] = {0};
+    JournalHeader* h = (JournalHeader*) header;
+    h->magic = JOURNAL_MAGIC;
+    h->size = JOURNAL_SIZE;
+    h->next_seq = 1;
+    pwrite(fs_fd, header, sizeof(header), FAT_SIZE + DATA_REGION_SIZE);
+
     free(FAT_TABLE);
+    FAT_TABLE = NULL;
 
     close(fs_fd);
+    pennfat_use(prev);
+}
+
+// derives the FAT and data region sizes from the header fields
+void set_fat_geometry(int blocks_in_fat, int block_size_config, bool wide) {
+    BLOCKS_IN_FAT = blocks_in_fat;
+    BLOCK_SIZE_CONFIG = block_size_config;
+    BLOCK_SIZE = 256 << BLOCK_SIZE_CONFIG; // 256, 512, 1024, 2048 or 4096
+    FAT_ENTRY_SIZE = wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    FAT_SIZE = BLOCK_SIZE * BLOCKS_IN_FAT;
+    NUM_FAT_ENTRIES = FAT_SIZE / FAT_ENTRY_SIZE;
+    TABLE_REGION_SIZE = FAT_ENTRY_SIZE * NUM_FAT_ENTRIES;
+    // block 0xFFFF would collide with the FAT16 end-of-chain marker
+    if (!wide && NUM_FAT_ENTRIES > MAX_FAT_ENTRIES) {
+        DATA_REGION_SIZE = (int64_t) BLOCK_SIZE * (NUM_FAT_ENTRIES - 2);
+    } else {
+        DATA_REGION_SIZE = (int64_t) BLOCK_SIZE * (NUM_FAT_ENTRIES - 1);
+    }
 }
 
 void mount(const char *fs_name) {
+    mount_with_flags(fs_name, 0);
+}
+
+void mount_with_flags(const char *fs_name, int flags) {
     // Open the file system file
     // int fs_fd = open(fs_name, O_RDWR);
     // if (fs_fd == -1) {
@@ -123,80 +440,108 @@ void mount(const char *fs_name) {
     
     int fs_fd = open(fs_name, O_RDWR);
     if (fs_fd == -1) {
-        perror("Error creating file system image");
-        exit(1);
+        perror("Error opening file system image");
+        return;
     }
 
-    uint16_t metadata = 0;
-    read(fs_fd, &metadata, sizeof(uint16_t));
-    BLOCKS_IN_FAT = metadata >> 8;
-    BLOCK_SIZE_CONFIG = metadata & 0xFF;
-    // printf("%u %u\n", BLOCKS_IN_FAT, BLOCK_SIZE_CONFIG);
-    switch(BLOCK_SIZE_CONFIG) {
-        case 0:
-            BLOCK_SIZE = 256;
-            break;
-        case 1:
-            BLOCK_SIZE = 512;
-            break;
-        case 2:
-            BLOCK_SIZE = 1024;
-            break;
-        case 3:
-            BLOCK_SIZE = 2048;
-            break;
-        case 4:
-            BLOCK_SIZE = 4096;
-            break;
+    // Validate the header once: FAT16 packs blocks_in_fat/block_size_config into one
+    // 16-bit entry, FAT32 flags the config byte and keeps blocks_in_fat in the upper 24 bits
+    uint32_t metadata = 0;
+    if (pread(fs_fd, &metadata, sizeof(uint32_t), 0) != sizeof(uint32_t)) {
+        fprintf(stderr, "Error: %s is not a PennFAT image\n", fs_name);
+        close(fs_fd);
+        return;
     }
-    FAT_SIZE = BLOCK_SIZE * BLOCKS_IN_FAT;
-    NUM_FAT_ENTRIES = (BLOCK_SIZE * BLOCKS_IN_FAT) / 2;
-    TABLE_REGION_SIZE = sizeof(uint16_t) * NUM_FAT_ENTRIES;
-
-    if (BLOCK_SIZE == 4096 && BLOCKS_IN_FAT == 32) {
-        DATA_REGION_SIZE = BLOCK_SIZE * (NUM_FAT_ENTRIES - 2);
-    } else {
-        DATA_REGION_SIZE = BLOCK_SIZE * (NUM_FAT_ENTRIES - 1);
+    bool wide = metadata & FAT32_HEADER_FLAG;
+    int block_size_config = metadata & 0x7F;
+    int blocks_in_fat = wide ? (int) (metadata >> 8) : (int) ((metadata >> 8) & 0xFF);
+    int max_blocks_in_fat = wide ? MAX_FAT32_BLOCKS_IN_FAT : 32;
+    if (blocks_in_fat < 1 || blocks_in_fat > max_blocks_in_fat || block_size_config > 4) {
+        fprintf(stderr, "Error: %s has an invalid PennFAT header\n", fs_name);
+        close(fs_fd);
+        return;
     }
+    // printf("%u %u\n", BLOCKS_IN_FAT, BLOCK_SIZE_CONFIG);
+    set_fat_geometry(blocks_in_fat, block_size_config, wide);
 
-    // Initialize the file descriptor table (FDT)
-    FDT = calloc(1, sizeof(FDTEntry*) * NUM_FAT_ENTRIES);
+    struct stat st;
+    if (fstat(fs_fd, &st) == -1 || st.st_size < (off_t) FAT_SIZE + DATA_REGION_SIZE) {
+        fprintf(stderr, "Error: %s is smaller than its header says\n", fs_name);
+        close(fs_fd);
+        return;
+    }
 
-    // Mmap for FAT table region
-    FAT_TABLE = mmap(NULL, FAT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
+    // The file descriptor table (FDT) starts empty and grows as files are opened
+    FDT = NULL;
+    NUM_FDT_ENTRIES = 0;
+
+    // Images made before the journal existed have no journal region and are not journaled
+    off_t journal_offset = (off_t) FAT_SIZE + DATA_REGION_SIZE;
+    JournalHeader journal_header;
+    bool journaled = st.st_size >= journal_offset + JOURNAL_SIZE
+        && journal_read_header(fs_fd, journal_offset, &journal_header);
+
+    // Mmap for FAT table region. While journaling the mapping is private: FAT updates
+    // reach the image only at a checkpoint, after the records describing them.
+    // MAP_POPULATE prefaults the FAT in one go instead of a fault per page.
+    int map_flags = journaled ? MAP_PRIVATE : MAP_SHARED;
+#ifdef MAP_POPULATE
+    map_flags |= MAP_POPULATE;
+#endif
+    FAT_TABLE = mmap(NULL, FAT_SIZE, PROT_READ | PROT_WRITE, map_flags, fs_fd, 0);
     if (FAT_TABLE == MAP_FAILED) {
         perror("Error mmapping the directory entries");
         close(fs_fd);
         exit(1);
     }
-
-    FAT_TABLE[0] = metadata;
-    
-    for (int i = 1; i < NUM_FAT_ENTRIES; i++) {
-        // FAT_TABLE[i] = 0;
-        read(fs_fd, &FAT_TABLE[i], 2);
+    madvise(FAT_TABLE, FAT_SIZE, MADV_WILLNEED);
+    fat_dirty_init(journaled);
+
+    // In MOUNT_MMAP_DATA mode the data region gets its own shared mapping; it is not
+    // page aligned on its own, so the mapping starts at the page holding its first byte
+    FAT_DATA = NULL;
+    if (flags & MOUNT_MMAP_DATA) {
+        off_t map_offset = FAT_SIZE & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+        DATA_MAP_SIZE = (FAT_SIZE - map_offset) + DATA_REGION_SIZE;
+        DATA_MAP = mmap(NULL, DATA_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, map_offset);
+        if (DATA_MAP == MAP_FAILED) {
+            perror("Error mmapping the data region");
+            close(fs_fd);
+            exit(1);
+        }
+        FAT_DATA = DATA_MAP + (FAT_SIZE - map_offset);
+        madvise(DATA_MAP, DATA_MAP_SIZE, MADV_WILLNEED);
     }
 
-    lseek(fs_fd, 2, SEEK_SET);
-
-    // Initialize the root directory
-    FAT_TABLE[1] = 0xFFFF; // First block of root directory is FFFF to signal it's the end
-    write(fs_fd, &FAT_TABLE[1], 2);
+    // Initialize the root directory if it has no chain yet
+    if (fat_get(1) == 0) {
+        fat_set(1, FAT_END); // First block of root directory is the end of its chain
+    }
     
-    FS_NAME = malloc(sizeof(char) * strlen(fs_name));
+    FS_NAME = malloc(sizeof(char) * (strlen(fs_name) + 1));
     strcpy(FS_NAME, fs_name); // save name
 
-    close(fs_fd);
+    // The image stays open for the life of the mount; all I/O is positional
+    FS_FD = fs_fd;
+
+    // blocks are read straight from the mapping when the data region is mapped
+    if (!FAT_DATA) {
+        cache_init();
+    }
+
+    // replay whatever was committed but not checkpointed before the index is built
+    if (journaled) {
+        journal_open(journal_offset, journal_header.next_seq);
+    }
+
+    // Index the root directory so lookups do not touch the image
+    root_index_build();
+    free_map_build();
 }
 
 // TODO: global var with fs_name
 void umount() {
-    // Open the file system file
-    int fs_fd = open(FS_NAME, O_RDWR);
-    if (fs_fd == -1) {
-        perror("Error opening file system image");
-        exit(1);
-    }
+    int fs_fd = FS_FD;
 
     // Free directory entries TODO
     // 1. Start at fat table index 1, and follow pointers to get location of all data blocks
@@ -220,37 +565,59 @@ void umount() {
     // }
     // 3. Free root_chain
     // free(root_chain);
+    // land buffered writes, commit and checkpoint the journal, then write back everything
+    // still dirty in the block cache
+    fdt_flush_all();
+    bool journaled = JOURNAL.active;
+    journal_close();
+    cache_flush();
+    cache_destroy();
+
     free(FS_NAME);
-    free(FDT);
+    FS_NAME = NULL;
+    fdt_destroy();
+    root_index_destroy();
+    free_map_destroy();
 
-    lseek(fs_fd, 0, SEEK_SET);
     // printf("%i\n", FAT_TABLE[1]);
     // printf("%i\n", FAT_TABLE[2]);
     // printf("%i\n", FAT_TABLE[3]);
     // printf("%i\n", FAT_TABLE[4]);
-    write(fs_fd, FAT_TABLE, FAT_SIZE);
+    // only the FAT pages that changed are written (the checkpoint has already done so when journaled)
+    if (!journaled) {
+        fat_flush();
+    }
+    fat_dirty_destroy();
 
-    // Unmap the memory-mapped region
+    // Unmap the memory-mapped regions
     if (munmap(FAT_TABLE, TABLE_REGION_SIZE) == -1) {
         perror("Error unmapping file system - table");
         close(fs_fd);
         exit(1);
     }
-
-    // if (munmap(FAT_DATA, DATA_REGION_SIZE) == -1) {
-    //     perror("Error unmapping file system - data");
-    //     close(fs_fd);
-    //     exit(1);
-    // }
+    if (DATA_MAP && munmap(DATA_MAP, DATA_MAP_SIZE) == -1) {
+        perror("Error unmapping file system - data");
+        close(fs_fd);
+        exit(1);
+    }
+    FAT_TABLE = NULL;
+    FAT_DATA = NULL;
+    DATA_MAP = NULL;
+    DATA_MAP_SIZE = 0;
 
     close(fs_fd);
+    FS_FD = -1;
 }
 
 // get chain of blocks for a file given the start index
 int* get_fat_chain(int start_index) {
     // write(1, "entered chain\n", sizeof(char) * strlen("entered chain\n"));
-    // malloc array for chain
-    int* fat_chain = malloc(sizeof(int) * NUM_FAT_ENTRIES);
+    // malloc array for chain (sized by the chain, not the FAT, which can be huge on FAT32)
+    int len = 0;
+    for (int block = start_index; block != FAT_END && block != 0; block = fat_get(block)) {
+        len++;
+    }
+    int* fat_chain = malloc(sizeof(int) * (len + 1));
     if (fat_chain == NULL) {
         return NULL;
     }
@@ -259,490 +626,1943 @@ int* get_fat_chain(int start_index) {
     int block = start_index;
     // go until END is reached
     // write(1, "enter loop\n", sizeof(char) * strlen("enter loop\n"));
-    while (block != 0xFFFF && block != 0) {
+    while (block != FAT_END && block != 0) {
         // write(1, "block\n", sizeof(char) * strlen("block\n"));
         fat_chain[i] = block;
-        block = FAT_TABLE[block];
+        block = fat_get(block);
         i++;
     }
+    // callers stop at the first 0
+    fat_chain[i] = 0;
     return fat_chain;
 }
 
-int strcat_data(char* data, int start_index) {
-    int fs_fd = open(FS_NAME, O_RDWR);
-    // int start_block = FAT_TABLE[start_index];
-    int next_block = start_index;
-    int chars_read = 0;
-    while (next_block != 0xFFFF && next_block != 0) {
-        char* cur_data = calloc(1, BLOCK_SIZE);
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (next_block - 1)), SEEK_SET);
-        // printf("%i\n", TABLE_REGION_SIZE + (BLOCK_SIZE * (next_block - 1)));
-        chars_read += read(fs_fd, cur_data, BLOCK_SIZE);
-        // write(1, "data is\n", sizeof(char)*strlen("data is\n"));
-        // write(1, cur_data, sizeof(char)*strlen(cur_data));
-        // write(STDOUT_FILENO, "strcat check: \n", sizeof(char) * strlen("strcat check: \n"));
-        // write(STDOUT_FILENO, cur_data, sizeof(char) * strlen(cur_data));
-        if (cur_data) {
-            strcat(data, cur_data);
-        }
-        next_block = FAT_TABLE[next_block];
+// FAT entries are 16 bits wide, or 32 bits on FAT32 images; both widths
+// read back FAT_END at the end of a chain
+int fat_get(int block) {
+    if (FAT_ENTRY_SIZE == sizeof(uint32_t)) {
+        uint32_t next = ((uint32_t*) FAT_TABLE)[block];
+        return next == 0xFFFFFFFF ? FAT_END : (int) next;
     }
-    // number of chars read
-    return chars_read;
+    uint16_t next = FAT_TABLE[block];
+    return next == 0xFFFF ? FAT_END : next;
 }
 
-int find_first_free_block() {
-    for (int i = 1; i < NUM_FAT_ENTRIES; i++) {
-        if (FAT_TABLE[i] == 0) {
-            return i;
-        }
+void fat_set(int block, int value) {
+    if (JOURNAL.active) {
+        journal_log_fat(block, value);
+    }
+    if (FAT_DIRTY.words) {
+        int page = (int) (((int64_t) block * FAT_ENTRY_SIZE) / FAT_DIRTY.page_size);
+        FAT_DIRTY.words[page / 64] |= (uint64_t) 1 << (page % 64);
+    }
+    if (FAT_ENTRY_SIZE == sizeof(uint32_t)) {
+        ((uint32_t*) FAT_TABLE)[block] = value == FAT_END ? 0xFFFFFFFF : (uint32_t) value;
+    } else {
+        FAT_TABLE[block] = value == FAT_END ? 0xFFFF : (uint16_t) value;
     }
-    return -1;
 }
 
-int delete_from_penn_fat(const char *filename) {
-    // See if file currently exists by iterating through root directory
-    DirectoryEntry* entry = get_entry_from_root(filename, true, NULL);
-    if (!entry) {
-        perror("Source file does not exist");
-        return 0;
+// FAT32 keeps the upper half of the first block in firstBlockHi
+int entry_first_block(const DirectoryEntry* entry) {
+    if (FAT_ENTRY_SIZE == sizeof(uint32_t)) {
+        uint32_t first = ((uint32_t) entry->firstBlockHi << 16) | entry->firstBlock;
+        return first == 0xFFFFFFFF ? FAT_END : (int) first;
     }
+    return entry->firstBlock == 0xFFFF ? FAT_END : entry->firstBlock;
+}
 
-    int fs_fd = open(FS_NAME, O_RDWR);
+void set_entry_first_block(DirectoryEntry* entry, int block) {
+    uint32_t first = block == FAT_END ? 0xFFFFFFFF : (uint32_t) block;
+    entry->firstBlock = first & 0xFFFF;
+    entry->firstBlockHi = FAT_ENTRY_SIZE == sizeof(uint32_t) ? first >> 16 : 0;
+    // a new chain has no known tail yet
+    set_entry_tail(entry, 0);
+}
 
-    // Delete file from fat table if it does exist
-    int block = entry->firstBlock;
-    // char nullChar = '\0';
-    int zero = 0x0000;
-    while (block != 0xFFFF && block != 0) {
-        int next_block = FAT_TABLE[block];
-        FAT_TABLE[block] = 0x0000;
-        lseek(fs_fd, block * 2, SEEK_SET);
-        write(fs_fd, &zero, 2);
-        printf("DELETE %i\n", block);
-        // lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block - 1)), SEEK_SET);
-        // write(fs_fd, &nullChar, sizeof(char));
-        block = next_block;
+// Returns the block holding the last byte of the file, or 0 when it is not known.
+// tailUsed must still agree with the size, so entries whose size was changed
+// without recording the tail (older images included) are never trusted.
+int entry_tail_block(const DirectoryEntry* entry) {
+    if (entry->tailBlock == 0 || entry->size == 0) {
+        return 0;
     }
+    if (entry->tailUsed != (entry->size - 1) % BLOCK_SIZE + 1) {
+        return 0;
+    }
+    return entry->tailBlock;
+}
+// Records BLOCK (0 to forget it) as the block holding the file's last byte at its current size.
+void set_entry_tail(DirectoryEntry* entry, int block) {
+    entry->tailBlock = entry->size > 0 ? block : 0;
+    entry->tailUsed = entry->tailBlock ? (entry->size - 1) % BLOCK_SIZE + 1 : 0;
+}
 
-    // write updated FAT table to file
-    // lseek(fs_fd, 0, SEEK_SET);
-    // ssize_t num = write(fs_fd, FAT_TABLE, TABLE_REGION_SIZE);
-    // printf("%zd", num);
-
-    // Delete entry from root directory
-    delete_entry_from_root(filename);
-    close(fs_fd);
-    return 0;
+void fat_dirty_init(bool private_map) {
+    fat_dirty_destroy();
+    FAT_DIRTY.page_size = sysconf(_SC_PAGESIZE);
+    FAT_DIRTY.num_pages = (FAT_SIZE + FAT_DIRTY.page_size - 1) / FAT_DIRTY.page_size;
+    FAT_DIRTY.words = calloc((FAT_DIRTY.num_pages + 63) / 64, sizeof(uint64_t));
+    FAT_DIRTY.private_map = private_map;
 }
 
-DirectoryEntry* get_entry_from_root(const char *filename, bool update_first_block, char* rename_to) {
-    // write(1, "getting entry\n", sizeof(char) * strlen("getting entry\n"));
-    int start_block = 1;
-    int next_block = start_block;
-    int fs_fd = open(FS_NAME, O_RDWR);
+void fat_dirty_destroy() {
+    free(FAT_DIRTY.words);
+    memset(&FAT_DIRTY, 0, sizeof(FatDirty));
+}
 
-    int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-    // write(1, "init vals\n", sizeof(char) * strlen("init vals\n"));
-
-    // Iterate through all the root blocks
-    while (next_block != 0xFFFF && next_block != 0) {
-        // write(1, "loop iter\n", sizeof(char) * strlen("loop iter\n"));
-        // Check if file exists in current block (go through current root block's entries)
-        int block_to_check = next_block;
-        // seg fault here since going out of bounds of file size
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)), SEEK_SET);
-        
-        for (int i = 0; i < num_entries; i++) {
-            // write(1, "num_entry\n", sizeof(char) * strlen("num_entry\n"));
-            DirectoryEntry* read_struct = calloc(1, sizeof(DirectoryEntry));
-            read(fs_fd, read_struct, sizeof(DirectoryEntry));
-            
-            // if wanted file has been found
-            if (read_struct && strcmp(read_struct->name, filename) == 0) {
-                if (update_first_block) {
-                    if (read_struct->firstBlock == (uint16_t) -1) {
-                        read_struct->firstBlock = find_first_free_block();
-                        read_struct->mtime = time(NULL);
-                        FAT_TABLE[read_struct->firstBlock] = 0xFFFF;
-                        lseek(fs_fd, read_struct->firstBlock, SEEK_SET);
-                        write(fs_fd, &FAT_TABLE[read_struct->firstBlock], 2);
-                        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)) + (i * sizeof(DirectoryEntry)), SEEK_SET);
-                        write(fs_fd, read_struct, sizeof(DirectoryEntry));
-                    }
-                }
-                if (rename_to != NULL) {
-                    // printf("Rename to: %s\n", rename_to);
-                    strcpy(read_struct->name, rename_to);
-                    // printf("New name is: %s\n", read_struct->name);
-                    read_struct->mtime = time(NULL);
-                    lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)) + (i * sizeof(DirectoryEntry)), SEEK_SET);
-                    write(fs_fd, read_struct, sizeof(DirectoryEntry));
-                }
-                // free(read_struct);
-                close(fs_fd);
-                return read_struct;
-            }
-            free(read_struct);
-        }
-
-        // int max_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-        // if (listEntries){
-        //     for (int j = 0; j < max_entries; j++) {
-        //         DirectoryEntry* entry = listEntries[j];
-        //         // Update timestamp to current system time if it exists
-        //         if (entry && entry->name && strcmp(entry->name, filename) == 0) {
-        //             return entry;
-        //         }
-        //     }
-        // }
-
-        // check if out of bounds
-        if (next_block >= NUM_FAT_ENTRIES) {
-            break;
+// writes FAT pages first_page..last_page (inclusive) to the image and marks them clean
+int fat_flush_pages(int first_page, int last_page) {
+    off_t start = (off_t) first_page * FAT_DIRTY.page_size;
+    off_t end = (off_t) (last_page + 1) * FAT_DIRTY.page_size;
+    if (end > FAT_SIZE) {
+        end = FAT_SIZE;
+    }
+    int ret = 0;
+    if (FAT_DIRTY.private_map) {
+        if (pwrite(FS_FD, (char*) FAT_TABLE + start, end - start, start) != end - start) {
+            ret = -1;
         }
-        next_block = FAT_TABLE[next_block];
+    } else if (msync((char*) FAT_TABLE + start, end - start, MS_SYNC) == -1) {
+        ret = -1;
     }
-    close(fs_fd);
-
-    return NULL;
+    if (ret < 0) {
+        perror("Error writing FAT");
+        return -1;
+    }
+    for (int page = first_page; page <= last_page; page++) {
+        FAT_DIRTY.words[page / 64] &= ~((uint64_t) 1 << (page % 64));
+    }
+    return 0;
 }
 
-DirectoryEntry* delete_entry_from_root(const char *filename) {
-    int start_block = 1;
-    int next_block = start_block;
-    int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-    int fs_fd = open(FS_NAME, O_RDWR);
-
-    // Iterate through all the root blocks
-    while (next_block != 0xFFFF && next_block != 0) {
-        // Check if file exists in current block (go through current root block's entries)
-        int block_to_check = next_block;
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)), SEEK_SET);
-        for (int i = 0; i < num_entries; i++) {
-            DirectoryEntry* read_struct = calloc(1, sizeof(DirectoryEntry));
-            // fread(&read_struct, sizeof(read_struct), 1, file_ptr);
-            read(fs_fd, read_struct, sizeof(DirectoryEntry));
-            if (read_struct && strcmp(read_struct->name, filename) == 0) {
-                // overwrite with spaces
-                // make name empty string
-                lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)) + (sizeof(DirectoryEntry) * i), SEEK_SET);
-                read_struct->name[0] = '\0';
-                write(fs_fd, read_struct, sizeof(DirectoryEntry));
-
-                return read_struct;
-            }
+// writes every dirty FAT page, one write per run of consecutive dirty pages
+int fat_flush() {
+    if (!FAT_DIRTY.words) {
+        return 0;
+    }
+    int ret = 0;
+    int page = 0;
+    while (page < FAT_DIRTY.num_pages) {
+        uint64_t word = FAT_DIRTY.words[page / 64] >> (page % 64);
+        if (word == 0) {
+            // rest of this word is clean
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        page += __builtin_ctzll(word);
+        int last = page;
+        while (last + 1 < FAT_DIRTY.num_pages && (FAT_DIRTY.words[(last + 1) / 64] >> ((last + 1) % 64)) & 1) {
+            last++;
+        }
+        if (fat_flush_pages(page, last) < 0) {
+            ret = -1;
+        }
+        page = last + 1;
+    }
+    return ret;
+}
 
-            free(read_struct);
-        }
-
-        // DirectoryEntry** listEntries = FAT_DATA[block_to_check]; 
-        // int max_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-        // if (listEntries){
-        //     for (int j = 0; j < max_entries; j++) {
-        //         DirectoryEntry* entry = listEntries[j];
-        //         if (entry && entry->name && strcmp(entry->name, filename) == 0) {
-        //             free(entry->name);
-        //             listEntries[j] = NULL;
-        //             return;
-        //         }
-                
-        //     }
-        // }
-        
-        next_block = FAT_TABLE[next_block];
+// writes the FAT page holding `block`'s entry if it is dirty
+int fat_flush_entry(int block) {
+    if (!FAT_DIRTY.words) {
+        return 0;
     }
-    return NULL;
+    int page = (int) (((int64_t) block * FAT_ENTRY_SIZE) / FAT_DIRTY.page_size);
+    if (!((FAT_DIRTY.words[page / 64] >> (page % 64)) & 1)) {
+        return 0;
+    }
+    return fat_flush_pages(page, page);
 }
 
-int add_entry_to_root(DirectoryEntry* entry) {
-    int start_block = 1;
+// writes back a run of consecutive data blocks: dirty cache slots in cached mode,
+// or one msync over the pages holding them in MOUNT_MMAP_DATA mode
+int data_sync_run(int first_block, int count) {
+    if (FAT_DATA) {
+        char* start = block_data(first_block);
+        char* end = start + (size_t) count * BLOCK_SIZE;
+        char* aligned = DATA_MAP + (((start - DATA_MAP) / FAT_DIRTY.page_size) * FAT_DIRTY.page_size);
+        return msync(aligned, end - aligned, MS_SYNC);
+    }
+    return cache_write_back_run(first_block, count);
+}
 
-    int last_block = start_block;
-    int next_block = start_block;
-    int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-    int fs_fd = open(FS_NAME, O_RDWR);
-    bool found = false;
+// Writes any dirty cached copies of blocks [first_block, first_block + count)
+// back to the image so the kernel's view of the run is current.
+int cache_write_back_run(int first_block, int count) {
+    int ret = 0;
+    pthread_mutex_lock(&CACHE_LOCK);
+    for (int block = first_block; block < first_block + count; block++) {
+        CacheBlock* cb = cache_find(block);
+        if (cb && cache_write_back(cb) < 0) {
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return ret;
+}
 
-    // Iterate through all the root blocks until we find final one
-    while (next_block != 0xFFFF) {
-        last_block = next_block;
-        next_block = FAT_TABLE[next_block];
+// writes `count` whole blocks starting at first_block with a single pwrite; cached copies
+// are dropped since every byte of them is replaced. Returns the bytes written, -1 on error.
+int data_write_run(int first_block, int count, const char* buf) {
+    size_t len = (size_t) count * BLOCK_SIZE;
+    if (FAT_DATA) {
+        memcpy(block_data(first_block), buf, len);
+        return len;
     }
-    
-    // Check if there is space in the last root block
-    int block_to_check = last_block;
-    // Seek to access DIRECTORY-BLOCK in the DATA region that contains the file we are looking for
-    lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)), SEEK_SET); 
-
-    for (int i = 0; i < num_entries; i++) {
-        // Go through this DIRECTORY-BLOCK to find the first empty file space
-        // char buffer[sizeof(DirectoryEntry)];
-        DirectoryEntry* read_struct = (DirectoryEntry*) calloc(1, sizeof(DirectoryEntry));
-        // read(fs_fd, buffer, sizeof(DirectoryEntry))
-        // if (memcmp(buffer, " ", sizeof(DirectoryEntry)) == 0) { 
-            
-        // }
-        if (read_struct == NULL) {
-            perror("Error allocating memory for read_struct in add_entry_to_root");
+    for (int i = 0; i < count; i++) {
+        cache_drop(first_block + i);
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t put = pwrite(FS_FD, buf + done, len - done, data_block_offset(first_block) + done);
+        if (put <= 0) {
+            perror("Error writing data blocks");
             break;
         }
+        done += put;
+    }
+    // a block that was only partly written does not count
+    done -= done % BLOCK_SIZE;
+    return done > 0 ? (int) done : -1;
+}
 
-        read(fs_fd, read_struct, sizeof(DirectoryEntry)); //, 1, fs_fd);
-        // printf("%d read_struct: %s\n", i, read_struct->name);
-        // check if name is empty
-        // if (strcmp(read_struct->name, "") == 0) {
-
-        // empty or deleted struct space
-        if (read_struct->name[0] == 0 || read_struct->name[0] == '\0') {
-            // empty space found
-            lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)) + (i * sizeof(DirectoryEntry)), SEEK_SET); 
-            write(fs_fd, entry, sizeof(DirectoryEntry));//, 1, fs_fd);
-            found = true;
-            // printf("%d read_struct: %s\n", i, read_struct->name);
+// Copies blocks [first_block, first_block + count) into buf with one pread, after writing
+// back any dirty cached copies. Returns the bytes copied (whole blocks only), -1 on error.
+int data_read_run(int first_block, int count, char* buf) {
+    size_t len = (size_t) count * BLOCK_SIZE;
+    if (FAT_DATA) {
+        memcpy(buf, block_data(first_block), len);
+        return len;
+    }
+    if (cache_write_back_run(first_block, count) < 0) {
+        return -1;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(FS_FD, buf + done, len - done, data_block_offset(first_block) + done);
+        if (got <= 0) {
+            if (got < 0) {
+                perror("Error reading data blocks");
+            }
             break;
         }
-        
-        free(read_struct);
+        done += got;
     }
+    done -= done % BLOCK_SIZE;
+    return done > 0 ? (int) done : -1;
+}
 
-    // DirectoryEntry** listEntries = FAT_DATA[block_to_check];
-    // int max_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-    // if (listEntries){
-    //     for (int j = 0; j < max_entries; j++) {
-    //         DirectoryEntry* entry = listEntries[j];
-    //         // Update timestamp to current system time if it exists
-    //         if (!entry) {
-    //             listEntries[j] = entry;
-    //             return 0;
-    //         }
-    //     }
-    // }
+// byte offset in the image of data block `block`
+off_t data_block_offset(int block) {
+    return TABLE_REGION_SIZE + ((off_t) BLOCK_SIZE * (block - 1));
+}
 
-    // If no space, add another block to the FAT chain
-    if (found) {
-        return 0;
+// address of a block inside the mapped data region, NULL when the data region is not mapped
+char* block_data(int block) {
+    if (!FAT_DATA) {
+        return NULL;
     }
-    int new_final_block = find_first_free_block();
-    // printf("new_final_block: %d\n", new_final_block);
-    FAT_TABLE[last_block] = new_final_block;
-    FAT_TABLE[new_final_block] = 0xFFFF;
-    // update FAT table with new block
-    lseek(fs_fd, last_block * 2, SEEK_SET);
-    write(fs_fd, &FAT_TABLE[last_block], 2);
-    lseek(fs_fd, new_final_block * 2, SEEK_SET);
-    write(fs_fd, &FAT_TABLE[new_final_block], 2);
-
-    // write entry to root
-    lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (new_final_block - 1)), SEEK_SET);
-    write(fs_fd, entry, sizeof(DirectoryEntry));
-
-    return 0;
+    return FAT_DATA + (size_t) BLOCK_SIZE * (block - 1);
 }
 
-int touch(const char *filename) {
-    if (strlen(filename) > MAX_FILENAME_LENGTH) {
-        perror("Error: filename too long");
-        return -1;
-    }
-    if (filename[0] == '\0') {
-        perror("Error: filename cannot be empty");
-        return -1;
+void cache_init() {
+    cache_destroy();
+    int capacity = CACHE_BLOCKS > 0 ? CACHE_BLOCKS : 1;
+    CACHE.slots = calloc(capacity, sizeof(CacheBlock));
+    CACHE.arena = malloc((size_t) capacity * BLOCK_SIZE);
+    CACHE.num_buckets = 1;
+    while (CACHE.num_buckets < capacity) {
+        CACHE.num_buckets *= 2;
     }
-    if (filename[0] == '.' || filename[0] == '/' || filename[0] == '\\' || filename[0] == ':') {
-        perror("Error: filename cannot start with ', /, \\, or :'");
-        return -1;
+    CACHE.buckets = calloc(CACHE.num_buckets, sizeof(CacheBlock*));
+    if (!CACHE.slots || !CACHE.arena || !CACHE.buckets) {
+        perror("Error allocating block cache");
+        exit(1);
     }
-    // See if file currently exists by iterating through root directory
-    DirectoryEntry* entry = get_entry_from_root(filename, false, NULL);
-    if (entry) {
-        // printf("Found entry for file in touch\n");
-        entry->mtime = time(NULL);
-        return 0;
+    CACHE.capacity = capacity;
+    // every slot starts on the LRU list as an unused block
+    for (int i = 0; i < capacity; i++) {
+        CacheBlock* cb = &CACHE.slots[i];
+        cb->data = CACHE.arena + (size_t) i * BLOCK_SIZE;
+        cb->prev = i > 0 ? &CACHE.slots[i - 1] : NULL;
+        cb->next = i < capacity - 1 ? &CACHE.slots[i + 1] : NULL;
     }
+    CACHE.lru_head = &CACHE.slots[0];
+    CACHE.lru_tail = &CACHE.slots[capacity - 1];
+}
 
-    // Create file if it does not exist
-    entry = calloc(1, sizeof(DirectoryEntry));
-    strcpy(entry->name, filename);
-    entry->size = 0;
-    entry->firstBlock = -1; // firstBlock is undefined (null) when size = 0
-    entry->type = 1; // TODO: is how do we set type
-    entry->perm = 7; // TODO: is how do we set perm
-    entry->mtime = time(NULL); // set time to now TODO: is this correct function call?
+void cache_destroy() {
+    free(CACHE.slots);
+    free(CACHE.arena);
+    free(CACHE.buckets);
+    memset(&CACHE, 0, sizeof(BlockCache));
+}
 
-    // Save pointer at the end of root entries block
-    if (add_entry_to_root(entry) == -1) {
-        perror("Error: no empty entries in root directory");
-        return -1;
+void cache_unlink_lru(CacheBlock* cb) {
+    if (cb->prev) cb->prev->next = cb->next; else CACHE.lru_head = cb->next;
+    if (cb->next) cb->next->prev = cb->prev; else CACHE.lru_tail = cb->prev;
+    cb->prev = cb->next = NULL;
+}
+
+void cache_push_front(CacheBlock* cb) {
+    cb->prev = NULL;
+    cb->next = CACHE.lru_head;
+    if (CACHE.lru_head) CACHE.lru_head->prev = cb; else CACHE.lru_tail = cb;
+    CACHE.lru_head = cb;
+}
+
+void cache_unhash(CacheBlock* cb) {
+    CacheBlock** link = &CACHE.buckets[cb->block & (CACHE.num_buckets - 1)];
+    while (*link && *link != cb) {
+        link = &(*link)->hash_next;
     }
-    // printf("TOUCH %s\n", entry->name);
-    // f_ls(NULL);
-    free(entry);
-    return 0;
+    if (*link) {
+        *link = cb->hash_next;
+    }
+    cb->hash_next = NULL;
 }
 
-int rm(const char *filename) {
-    // See if file currently exists by iterating through root directory
-    DirectoryEntry* entry = get_entry_from_root(filename, false, NULL);
-    if (!entry) {
-        perror("Source file does not exist");
+// writes one cached block back to the image if it is dirty
+int cache_write_back(CacheBlock* cb) {
+    if (cb->block == 0 || !cb->dirty) {
         return 0;
     }
-    delete_from_penn_fat(filename);
-    // // Delete file from fat table if it does exist
-    // int block = entry->firstBlock;
-    // while (block != 0xFFFF && block != 0) {
-    //     int next_block = FAT_TABLE[block];
-    //     FAT_TABLE[block] = 0;
-    //     block = next_block;
-    // }
-
-    // // Delete entry from root directory
-    // delete_entry_from_root(filename);
+    if (pwrite(FS_FD, cb->data, BLOCK_SIZE, data_block_offset(cb->block)) != BLOCK_SIZE) {
+        perror("Error writing back cached block");
+        return -1;
+    }
+    cb->dirty = false;
     return 0;
 }
 
-int mv(const char *source, const char *dest) {
-    // TODO: add function to validate name
-
-    // See if file currently exists by iterating through root directory
-    DirectoryEntry* entry = get_entry_from_root(source, false, NULL);
-    if (!entry) {
-        perror("Error: source file does not exist");
-        return -1;
+// Returns the cache slot holding `block`, or NULL if it is not cached.
+CacheBlock* cache_find(int block) {
+    CacheBlock* cb = CACHE.buckets[block & (CACHE.num_buckets - 1)];
+    while (cb && cb->block != block) {
+        cb = cb->hash_next;
     }
-    // delete dest file
-    rm(dest);
-    // rename
-    entry = get_entry_from_root(source, false, (char*) dest);
-
-    return 0;
+    return cb;
 }
 
-// adds data to end of file, given a block number in the file
-int append_to_penn_fat(char* data, int block_no, int n, int size) {
-    // write(1, "APPENDING\n", sizeof(char) * strlen("APPENDING\n"));
-    // Find last block in file (assumes delete_from_penn_fat removes all old blocks)
-    // printf("[DEBUG] append_to_penn_fat - block_no: %d, str: %s\n", block_no, data);
-
-    int last_block = block_no;
-    int next_block = last_block;
-    int fs_fd = open(FS_NAME, O_RDWR);
-    printf("BLOCK NO %i\n", block_no);
-    while (next_block != 0xFFFF && next_block != 0) {
-        last_block = next_block;
-        next_block = FAT_TABLE[next_block];
-    }
-    printf("LAST BLOCK %i\n", last_block);
-    // write(1, "Here\n", sizeof(char) * strlen("Here\n"));
-    // Iterate through data block by block (each block is block_size bytes)
-    char* cur_data_block = malloc(BLOCK_SIZE);
-    int offset = 0;
-
-    // read what's in last block to determine block text length
-    lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (last_block - 1)), SEEK_SET);
-    int bytes_read = 0;
-    if (size != 0) {
-        read(fs_fd, cur_data_block, BLOCK_SIZE);
+// Frees the least recently used slot for reuse, writing it back first if it is dirty.
+// The slot holds no block until cache_insert gives it one.
+CacheBlock* cache_evict() {
+    CacheBlock* cb = CACHE.lru_tail;
+    if (cache_write_back(cb) < 0) {
+        return NULL;
     }
-    if (bytes_read < 0) {
-        perror("append_to_penn_fat - Error reading data block, bytes_read negative");
-        return -1;
+    if (cb->block != 0) {
+        cache_unhash(cb);
     }
+    cb->block = 0;
+    return cb;
+}
 
-    // If there is space remaing (char_rem > 0) in the last block
-        //      => THEN write char_rem number of bytes to the block
-    int bytes_rem = BLOCK_SIZE - bytes_read;
-    if (bytes_rem > 0) {   
-        int max_size = n < bytes_rem ? n : bytes_rem;
-        if (max_size < strlen(data) && max_size > 0) max_size -=  1; // subtract 1 to make room for for null terminator that strndup will add
-        cur_data_block = strndup(&data[offset], max_size);
-        if (!cur_data_block) {
-            perror("append_to_penn_fat - Error copying data block with strndup");
-            return -1;
-        }
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (last_block - 1)) + bytes_read, SEEK_SET);
-        write(fs_fd, cur_data_block, sizeof(char) * strlen(cur_data_block));
+// Files a slot whose data now holds `block` under that block number.
+void cache_insert(CacheBlock* cb, int block) {
+    cb->block = block;
+    cb->dirty = false;
+    int b = block & (CACHE.num_buckets - 1);
+    cb->hash_next = CACHE.buckets[b];
+    CACHE.buckets[b] = cb;
+}
 
-        if (strlen(data) > bytes_rem && n > bytes_rem) {
-            // If we stil have data left to write then set offset and continue with rest of program
-            offset = bytes_rem;
-        } else {
-            // Otherwise we are done and can return
-            free(cur_data_block);
-            return bytes_rem;
+// Returns the cache slot holding `block`, loading it (and evicting the least
+// recently used block) on a miss. If the caller is about to overwrite the
+// whole block the read from the image is skipped.
+CacheBlock* cache_lookup(int block, bool will_overwrite) {
+    CacheBlock* cb = cache_find(block);
+    if (!cb) {
+        cb = cache_evict();
+        if (!cb) {
+            return NULL;
+        }
+        if (!will_overwrite) {
+            ssize_t got = pread(FS_FD, cb->data, BLOCK_SIZE, data_block_offset(block));
+            if (got < 0) {
+                return NULL;
+            }
+            if (got < BLOCK_SIZE) {
+                memset(cb->data + got, 0, BLOCK_SIZE - got);
+            }
         }
+        cache_insert(cb, block);
     }
-    
-    
-    while (offset < sizeof(char) * strlen(data)) {
-        // printf("offset: %i", offset);
-        n = n - offset  >= 1 ? n - offset : 0;
-        int max_size = n < BLOCK_SIZE ? n : BLOCK_SIZE;
-        if (max_size < strlen(data) && max_size > 0) max_size -=  1; // subtract 1 to make room for for null terminator that strndup will add
-        cur_data_block = strndup(&data[offset], max_size);
-        // write(1, cur_data_block, sizeof(char) * strlen(cur_data_block));
-        if (!cur_data_block) {
-            perror("append_to_penn_fat - Error copying data block with strndup");
+    if (cb != CACHE.lru_head) {
+        cache_unlink_lru(cb);
+        cache_push_front(cb);
+    }
+    return cb;
+}
+
+// Loads the uncached blocks of [first_block, first_block + count) with a single pread
+// of the run. Blocks already cached keep their (possibly dirty) contents.
+int cache_prefetch_run(int first_block, int count) {
+    if (count > CACHE.capacity / 4) {
+        count = CACHE.capacity / 4;
+    }
+    pthread_mutex_lock(&CACHE_LOCK);
+    // only the stretch between the first and last missing block is read
+    int lo = first_block;
+    int hi = first_block + count - 1;
+    while (lo <= hi && cache_find(lo)) {
+        lo++;
+    }
+    while (hi >= lo && cache_find(hi)) {
+        hi--;
+    }
+    if (lo > hi) {
+        pthread_mutex_unlock(&CACHE_LOCK);
+        return 0;
+    }
+
+    size_t len = (size_t) (hi - lo + 1) * BLOCK_SIZE;
+    char* run = malloc(len);
+    ssize_t got = pread(FS_FD, run, len, data_block_offset(lo));
+    int loaded = 0;
+    for (int block = lo; got > 0 && block <= hi; block++) {
+        size_t at = (size_t) (block - lo) * BLOCK_SIZE;
+        if (at + BLOCK_SIZE > (size_t) got) {
+            break;
+        }
+        if (cache_find(block)) {
+            continue;
+        }
+        CacheBlock* cb = cache_evict();
+        if (!cb) {
+            break;
+        }
+        memcpy(cb->data, run + at, BLOCK_SIZE);
+        cache_insert(cb, block);
+        if (cb != CACHE.lru_head) {
+            cache_unlink_lru(cb);
+            cache_push_front(cb);
+        }
+        loaded++;
+    }
+    free(run);
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return loaded;
+}
+
+// copies n bytes at `offset` within `block` out of the cache
+int cache_read(int block, int offset, char* buf, int n) {
+    if (FAT_DATA) {
+        memcpy(buf, block_data(block) + offset, n);
+        return n;
+    }
+    pthread_mutex_lock(&CACHE_LOCK);
+    CacheBlock* cb = cache_lookup(block, false);
+    if (cb) {
+        memcpy(buf, cb->data + offset, n);
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return cb ? n : -1;
+}
+
+// copies n bytes into `block` at `offset` and marks it dirty; written back later
+int cache_write(int block, int offset, const char* buf, int n) {
+    if (FAT_DATA) {
+        memcpy(block_data(block) + offset, buf, n);
+        return n;
+    }
+    pthread_mutex_lock(&CACHE_LOCK);
+    CacheBlock* cb = cache_lookup(block, offset == 0 && n == BLOCK_SIZE);
+    if (cb) {
+        memcpy(cb->data + offset, buf, n);
+        cb->dirty = true;
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return cb ? n : -1;
+}
+
+// writes the start of a block whose old contents are dead (newly allocated or past EOF):
+// no read from the image, and the rest of the block is zeroed
+int cache_write_fresh(int block, const char* buf, int n) {
+    if (FAT_DATA) {
+        memcpy(block_data(block), buf, n);
+        return n;
+    }
+    pthread_mutex_lock(&CACHE_LOCK);
+    CacheBlock* cb = cache_lookup(block, true);
+    if (cb) {
+        memcpy(cb->data, buf, n);
+        if (n < BLOCK_SIZE) {
+            memset(cb->data + n, 0, BLOCK_SIZE - n);
+        }
+        cb->dirty = true;
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return cb ? n : -1;
+}
+
+// forgets a block without writing it back (used once the block is freed)
+void cache_drop(int block) {
+    if (CACHE.num_buckets == 0) {
+        return;
+    }
+    pthread_mutex_lock(&CACHE_LOCK);
+    CacheBlock* cb = cache_find(block);
+    if (!cb) {
+        pthread_mutex_unlock(&CACHE_LOCK);
+        return;
+    }
+    cache_unhash(cb);
+    cb->block = 0;
+    cb->dirty = false;
+    // unused slots are the first to be reused
+    cache_unlink_lru(cb);
+    cb->prev = CACHE.lru_tail;
+    cb->next = NULL;
+    if (CACHE.lru_tail) CACHE.lru_tail->next = cb; else CACHE.lru_head = cb;
+    CACHE.lru_tail = cb;
+    pthread_mutex_unlock(&CACHE_LOCK);
+}
+
+// writes every dirty block back to the image, in block order
+void cache_flush() {
+    if (CACHE.capacity == 0) {
+        return;
+    }
+    int* order = malloc(sizeof(int) * CACHE.capacity);
+    int num_dirty = 0;
+    pthread_mutex_lock(&CACHE_LOCK);
+    for (int i = 0; i < CACHE.capacity; i++) {
+        if (CACHE.slots[i].block != 0 && CACHE.slots[i].dirty) {
+            order[num_dirty++] = i;
+        }
+    }
+    // insertion sort by block number so the write-back is sequential on the image
+    for (int i = 1; i < num_dirty; i++) {
+        int cur = order[i];
+        int j = i - 1;
+        while (j >= 0 && CACHE.slots[order[j]].block > CACHE.slots[cur].block) {
+            order[j + 1] = order[j];
+            j--;
+        }
+        order[j + 1] = cur;
+    }
+    for (int i = 0; i < num_dirty; i++) {
+        cache_write_back(&CACHE.slots[order[i]]);
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    free(order);
+}
+
+// FNV-1a over the (possibly unterminated) file name
+unsigned int root_index_hash(const char *filename) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME_LENGTH && filename[i] != '\0'; i++) {
+        hash ^= (unsigned char) filename[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void root_index_grow() {
+    int new_num_buckets = ROOT_INDEX.num_buckets ? ROOT_INDEX.num_buckets * 2 : 64;
+    RootIndexNode** new_buckets = calloc(new_num_buckets, sizeof(RootIndexNode*));
+    if (!new_buckets) {
+        return;
+    }
+    for (int i = 0; i < ROOT_INDEX.num_buckets; i++) {
+        RootIndexNode* node = ROOT_INDEX.buckets[i];
+        while (node) {
+            RootIndexNode* next = node->next;
+            unsigned int b = root_index_hash(node->entry.name) & (new_num_buckets - 1);
+            node->next = new_buckets[b];
+            new_buckets[b] = node;
+            node = next;
+        }
+    }
+    free(ROOT_INDEX.buckets);
+    ROOT_INDEX.buckets = new_buckets;
+    ROOT_INDEX.num_buckets = new_num_buckets;
+}
+
+RootIndexNode* root_index_find(const char *filename) {
+    if (!filename || ROOT_INDEX.num_buckets == 0) {
+        return NULL;
+    }
+    unsigned int b = root_index_hash(filename) & (ROOT_INDEX.num_buckets - 1);
+    for (RootIndexNode* node = ROOT_INDEX.buckets[b]; node; node = node->next) {
+        if (strncmp(node->entry.name, filename, MAX_FILENAME_LENGTH) == 0) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+RootIndexNode* root_index_insert(const DirectoryEntry* entry, int block, int slot) {
+    if (ROOT_INDEX.count >= ROOT_INDEX.num_buckets) {
+        root_index_grow();
+    }
+    RootIndexNode* node = malloc(sizeof(RootIndexNode));
+    if (!node) {
+        return NULL;
+    }
+    memcpy(&node->entry, entry, sizeof(DirectoryEntry));
+    node->block = block;
+    node->slot = slot;
+    node->chain_gen = ++CHAIN_GEN;
+    node->open_count = 0;
+    pthread_rwlock_init(&node->lock, NULL);
+    unsigned int b = root_index_hash(entry->name) & (ROOT_INDEX.num_buckets - 1);
+    node->next = ROOT_INDEX.buckets[b];
+    ROOT_INDEX.buckets[b] = node;
+    ROOT_INDEX.count++;
+    return node;
+}
+
+void root_index_remove(RootIndexNode* node) {
+    unsigned int b = root_index_hash(node->entry.name) & (ROOT_INDEX.num_buckets - 1);
+    RootIndexNode** link = &ROOT_INDEX.buckets[b];
+    while (*link && *link != node) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = node->next;
+        ROOT_INDEX.count--;
+    }
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+}
+
+void root_index_push_free(int block, int slot) {
+    if (ROOT_INDEX.num_free == ROOT_INDEX.cap_free) {
+        int new_cap = ROOT_INDEX.cap_free ? ROOT_INDEX.cap_free * 2 : 64;
+        RootSlot* grown = realloc(ROOT_INDEX.free_slots, sizeof(RootSlot) * new_cap);
+        if (!grown) {
+            return;
+        }
+        ROOT_INDEX.free_slots = grown;
+        ROOT_INDEX.cap_free = new_cap;
+    }
+    ROOT_INDEX.free_slots[ROOT_INDEX.num_free].block = block;
+    ROOT_INDEX.free_slots[ROOT_INDEX.num_free].slot = slot;
+    ROOT_INDEX.num_free++;
+}
+
+bool root_index_pop_free(int* block, int* slot) {
+    if (ROOT_INDEX.num_free == 0) {
+        return false;
+    }
+    ROOT_INDEX.num_free--;
+    *block = ROOT_INDEX.free_slots[ROOT_INDEX.num_free].block;
+    *slot = ROOT_INDEX.free_slots[ROOT_INDEX.num_free].slot;
+    return true;
+}
+
+// walks the root chain once, reading a whole block per syscall
+void root_index_build() {
+    root_index_destroy();
+    root_index_grow();
+
+    int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
+    DirectoryEntry* buf = malloc(BLOCK_SIZE);
+    int block = 1;
+    while (block != FAT_END && block != 0 && block < NUM_FAT_ENTRIES) {
+        DirectoryEntry* entries = (DirectoryEntry*) block_data(block);
+        if (!entries) {
+            entries = buf;
+            if (cache_read(block, 0, (char*) entries, BLOCK_SIZE) != BLOCK_SIZE) {
+                memset(entries, 0, BLOCK_SIZE);
+            }
+        }
+        // push free slots in reverse so the lowest slot is reused first
+        for (int i = num_entries - 1; i >= 0; i--) {
+            char marker = entries[i].name[0];
+            if (marker == 0 || marker == 1) {
+                root_index_push_free(block, i);
+            }
+        }
+        for (int i = 0; i < num_entries; i++) {
+            char marker = entries[i].name[0];
+            if (marker != 0 && marker != 1 && marker != 2) {
+                root_index_insert(&entries[i], block, i);
+            }
+        }
+        block = fat_get(block);
+    }
+    free(buf);
+}
+
+void root_index_destroy() {
+    for (int i = 0; i < ROOT_INDEX.num_buckets; i++) {
+        RootIndexNode* node = ROOT_INDEX.buckets[i];
+        while (node) {
+            RootIndexNode* next = node->next;
+            pthread_rwlock_destroy(&node->lock);
+            free(node);
+            node = next;
+        }
+    }
+    free(ROOT_INDEX.buckets);
+    free(ROOT_INDEX.free_slots);
+    memset(&ROOT_INDEX, 0, sizeof(RootIndex));
+}
+
+void chain_reset_cursor(FDTEntry* fdt) {
+    fdt->cursor_index = -1;
+    fdt->cursor_block = 0;
+    free(fdt->block_map);
+    fdt->block_map = NULL;
+    fdt->block_map_len = 0;
+}
+
+// builds the descriptor's logical -> physical block array with one walk of the chain
+void chain_build_map(RootIndexNode* node, FDTEntry* fdt) {
+    int len = 0;
+    int block = entry_first_block(&node->entry);
+    while (block != FAT_END && block != 0) {
+        len++;
+        block = fat_get(block);
+    }
+    free(fdt->block_map);
+    fdt->block_map = malloc(sizeof(int) * (len > 0 ? len : 1));
+    fdt->block_map_len = 0;
+    if (!fdt->block_map) {
+        return;
+    }
+    block = entry_first_block(&node->entry);
+    while (block != FAT_END && block != 0) {
+        fdt->block_map[fdt->block_map_len++] = block;
+        block = fat_get(block);
+    }
+}
+
+// Returns the physical block holding logical block `index` of the file.
+// With a descriptor, sequential access steps its cached cursor forward and
+// backward jumps use the lazily built block map, so the chain is not re-walked.
+// extend is the number of blocks the caller needs starting at `index` (0 = never allocate):
+// missing blocks (including the first) are then allocated as extents covering that whole range.
+// Returns -1 past the end of the chain (or when the file system is full).
+int chain_block_at(RootIndexNode* node, FDTEntry* fdt, int index, int extend) {
+    DirectoryEntry* entry = &node->entry;
+    if (entry_first_block(entry) == FAT_END || entry_first_block(entry) == 0) {
+        if (extend <= 0) {
+            return -1;
+        }
+        int got;
+        pthread_mutex_lock(&ALLOC_LOCK);
+        int first = alloc_extent(-1, index + extend, &got);
+        if (first != -1) {
+            // logged together with the chain, so a crash cannot leave the chain unreachable
+            set_entry_first_block(entry, first);
+            dir_write(node->block, node->slot, entry);
+        }
+        pthread_mutex_unlock(&ALLOC_LOCK);
+        if (first == -1) {
+            return -1;
+        }
+    }
+
+    int cur_index = 0;
+    int block = entry_first_block(entry);
+    if (fdt) {
+        if (fdt->chain_gen != node->chain_gen) {
+            chain_reset_cursor(fdt);
+            fdt->chain_gen = node->chain_gen;
+        }
+        if (fdt->cursor_index > index && !(fdt->block_map && index < fdt->block_map_len)) {
+            chain_build_map(node, fdt);
+        }
+        if (fdt->block_map && index < fdt->block_map_len) {
+            cur_index = index;
+            block = fdt->block_map[index];
+        } else if (fdt->cursor_index >= 0 && fdt->cursor_index <= index) {
+            cur_index = fdt->cursor_index;
+            block = fdt->cursor_block;
+        } else if (fdt->block_map_len > 0) {
+            cur_index = fdt->block_map_len - 1;
+            block = fdt->block_map[cur_index];
+        }
+    }
+    // appends start from the block holding EOF instead of walking the whole chain
+    int tail = entry_tail_block(entry);
+    if (tail > 0) {
+        int tail_index = (entry->size - 1) / BLOCK_SIZE;
+        if (tail_index <= index && tail_index > cur_index) {
+            cur_index = tail_index;
+            block = tail;
+        }
+    }
+
+    while (cur_index < index) {
+        int next = fat_get(block);
+        if (next == FAT_END || next == 0) {
+            if (extend <= 0) {
+                return -1;
+            }
+            // grow in place after the last block when possible, as one extent
+            int got;
+            pthread_mutex_lock(&ALLOC_LOCK);
+            next = alloc_extent(block + 1, index + extend - 1 - cur_index, &got);
+            if (next != -1) {
+                fat_set(block, next);
+            }
+            pthread_mutex_unlock(&ALLOC_LOCK);
+            if (next == -1) {
+                return -1;
+            }
+        }
+        block = next;
+        cur_index++;
+    }
+    if (fdt) {
+        fdt->cursor_index = index;
+        fdt->cursor_block = block;
+    }
+    return block;
+}
+
+// Reads up to n bytes of the file starting at byte offset `offset` into buf.
+// Only the blocks covering [offset, offset + n) are read.
+// Returns the number of bytes read (0 at EOF), negative on error.
+int read_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, char* buf, int n) {
+    DirectoryEntry* entry = &node->entry;
+    if (offset < 0) {
+        return -1;
+    }
+    if (offset >= entry->size || n == 0) {
+        return 0;
+    }
+    if (n > entry->size - offset) {
+        n = entry->size - offset;
+    }
+
+    int index = offset / BLOCK_SIZE;
+    int block_offset = offset % BLOCK_SIZE;
+    int total = 0;
+    while (total < n) {
+        int block = chain_block_at(node, fdt, index, 0);
+        if (block == -1) {
+            break;
+        }
+        int chunk = BLOCK_SIZE - block_offset;
+        if (chunk > n - total) {
+            chunk = n - total;
+        }
+        int got;
+        int blocks = 1;
+        if (n >= DIRECT_READ_BYTES && block_offset == 0 && n - total >= BLOCK_SIZE) {
+            // whole blocks of a large read come straight from the image, one pread per contiguous run
+            int max_blocks = (n - total) / BLOCK_SIZE;
+            while (blocks < max_blocks && chain_block_at(node, fdt, index + blocks, 0) == block + blocks) {
+                blocks++;
+            }
+            got = data_read_run(block, blocks, buf + total);
+        } else {
+            got = cache_read(block, block_offset, buf + total, chunk);
+        }
+        if (got <= 0) {
+            break;
+        }
+        total += got;
+        block_offset = 0;
+        index += blocks;
+    }
+    return total;
+}
+
+// Called before each f_read of [offset, offset + n). Once reads continue where the last
+// one stopped, the blocks ahead of them are loaded into the cache a contiguous run per
+// pread (or, on a mapped image, announced with posix_fadvise). The window starts at
+// RA_MIN_BLOCKS and doubles on every refill up to RA_MAX_BLOCKS; a jump resets it.
+void fdt_readahead(RootIndexNode* node, FDTEntry* fdt, int offset, int n) {
+    if (offset != fdt->ra_next || offset == 0) {
+        // not (yet) sequential
+        fdt->ra_window = 0;
+        fdt->ra_end = 0;
+        return;
+    }
+    DirectoryEntry* entry = &node->entry;
+    if (n >= DIRECT_READ_BYTES || offset >= entry->size) {
+        return;
+    }
+    int index = offset / BLOCK_SIZE;
+    int last_index = (entry->size - 1) / BLOCK_SIZE;
+    // refill once the reader is halfway through what was prefetched
+    if (fdt->ra_window > 0 && index + fdt->ra_window / 2 < fdt->ra_end) {
+        return;
+    }
+    fdt->ra_window = fdt->ra_window == 0 ? RA_MIN_BLOCKS : fdt->ra_window * 2;
+    if (fdt->ra_window > RA_MAX_BLOCKS) {
+        fdt->ra_window = RA_MAX_BLOCKS;
+    }
+    int from = fdt->ra_end > index ? fdt->ra_end : index;
+    int to = index + fdt->ra_window; // exclusive
+    if (to > last_index + 1) {
+        to = last_index + 1;
+    }
+    if (from >= to) {
+        return;
+    }
+    fdt->ra_end = to;
+
+    // step from the block under the read (where the cursor is needed next anyway)
+    int block = chain_block_at(node, fdt, index, 0);
+    for (int i = index; i < from && block != -1; i++) {
+        block = fat_get(block);
+        if (block == FAT_END || block == 0) {
+            block = -1;
+        }
+    }
+    if (block == -1) {
+        return;
+    }
+    int run_start = block;
+    int run_len = 1;
+    for (int i = from + 1; i <= to; i++) {
+        int next = i < to ? fat_get(block) : FAT_END;
+        if (next != FAT_END && next != 0 && next == run_start + run_len) {
+            run_len++;
+            block = next;
+            continue;
+        }
+        if (FAT_DATA) {
+            posix_fadvise(FS_FD, data_block_offset(run_start), (off_t) run_len * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+        } else {
+            cache_prefetch_run(run_start, run_len);
+        }
+        if (next == FAT_END || next == 0) {
+            break;
+        }
+        run_start = next;
+        run_len = 1;
+        block = next;
+    }
+}
+
+// fills the hole between EOF and the write position with zeros
+int fill_hole(RootIndexNode* node, FDTEntry* fdt, int offset) {
+    DirectoryEntry* entry = &node->entry;
+    char* zeros = calloc(1, BLOCK_SIZE);
+    while (entry->size < offset) {
+        int gap = offset - entry->size;
+        int chunk = gap < BLOCK_SIZE ? gap : BLOCK_SIZE;
+        if (write_at_offset(node, fdt, entry->size, zeros, chunk) != chunk) {
+            free(zeros);
+            return -1;
+        }
+    }
+    free(zeros);
+    return 0;
+}
+
+// Writes n bytes from buf into the file at byte offset `offset`.
+// Existing blocks are overwritten in place and new blocks are only allocated
+// past the current end of the chain. A gap between EOF and offset reads back as zeros.
+// Returns the number of bytes written (short if the file system fills up), negative on error.
+int write_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const char* buf, int n) {
+    DirectoryEntry* entry = &node->entry;
+    if (offset < 0 || n < 0) {
+        return -1;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    if (offset > entry->size && fill_hole(node, fdt, offset) < 0) {
+        return -1;
+    }
+
+    int old_size = entry->size;
+    int index = offset / BLOCK_SIZE;
+    int last_index = (offset + n - 1) / BLOCK_SIZE;
+    int block_offset = offset % BLOCK_SIZE;
+    int total = 0;
+    int last_block = 0; // block holding the last byte written
+    while (total < n) {
+        // walk (and extend if needed) the chain up to the block under the write position;
+        // blocks for the rest of the write are reserved in the same extent
+        int block = chain_block_at(node, fdt, index, last_index - index + 1);
+        if (block == -1) {
+            perror("File system full");
+            break;
+        }
+        int chunk = BLOCK_SIZE - block_offset;
+        if (chunk > n - total) {
+            chunk = n - total;
+        }
+        int put;
+        int blocks = 1;
+        if (!FAT_DATA && n >= DIRECT_WRITE_BYTES && block_offset == 0 && n - total >= BLOCK_SIZE) {
+            // whole blocks of a large write go straight to the image, one pwrite per contiguous run
+            int max_blocks = (n - total) / BLOCK_SIZE;
+            while (blocks < max_blocks
+                && chain_block_at(node, fdt, index + blocks, last_index - index - blocks + 1) == block + blocks) {
+                blocks++;
+            }
+            put = data_write_run(block, blocks, buf + total);
+        } else if (block_offset == 0 && (off_t) index * BLOCK_SIZE >= old_size) {
+            // nothing in this block belongs to the file yet, so it is not read first
+            put = cache_write_fresh(block, buf + total, chunk);
+        } else {
+            put = cache_write(block, block_offset, buf + total, chunk);
+        }
+        if (put <= 0) {
+            break;
+        }
+        last_block = block + (block_offset + put - 1) / BLOCK_SIZE;
+        total += put;
+        block_offset = 0;
+        index += blocks;
+    }
+    if (total == 0) {
+        return -1;
+    }
+
+    // size, tail and mtime are persisted once per call
+    if (offset + total >= entry->size) {
+        entry->size = offset + total;
+        set_entry_tail(entry, last_block);
+    }
+    entry->mtime = time(NULL);
+    write_entry_to_root(entry);
+    return total;
+}
+
+// Describes LEN bytes of the iovec array, starting SKIP bytes in, as slices in OUT
+// (at most iovcnt of them). Returns the number of slices.
+int iov_slice(const struct iovec* iov, int iovcnt, size_t skip, size_t len, struct iovec* out) {
+    int count = 0;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t take = iov[i].iov_len - skip;
+        if (take > len) {
+            take = len;
+        }
+        out[count].iov_base = (char*) iov[i].iov_base + skip;
+        out[count].iov_len = take;
+        count++;
+        len -= take;
+        skip = 0;
+    }
+    return count;
+}
+
+// Returns the total length of an iovec array, -1 if it is invalid or does not fit in an int.
+int iov_total(const struct iovec* iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt > 0 && !iov)) {
+        return -1;
+    }
+    int64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0 && !iov[i].iov_base) {
             return -1;
         }
-        offset += sizeof(char) * strlen(cur_data_block);
-        // Add new block to FAT chain
-        int new_final_block = find_first_free_block();
-        FAT_TABLE[last_block] = new_final_block;
-        FAT_TABLE[new_final_block] = 0xFFFF;
-        last_block = new_final_block;
-        // Write data to new block
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (new_final_block - 1)), SEEK_SET);
-        write(fs_fd, cur_data_block, sizeof(char) * strlen(cur_data_block));
-
-        if (n - strlen(cur_data_block) < 1) {
-            // Add null terminator and break
-            // printf("[DEBUG] append_to_penn_fat - adding null terminator\n");
-            free(cur_data_block);
-            write(fs_fd, "\0", sizeof(char));
-            return offset;
-        }
-    }
-    free(cur_data_block);
-    // write(1, "while done\n", sizeof(char) * strlen("while done\n"));
-    return strlen(data);
-}
-
-char* read_file_to_string(int fd) {
-    // Seek to the end of the file to determine its size
-    off_t file_size = lseek(fd, 0, SEEK_END);
-    if (file_size == -1) {
-        perror("Error seeking to end of file");
-        return NULL;
+        total += iov[i].iov_len;
+        if (total > INT_MAX) {
+            return -1;
+        }
+    }
+    return total;
+}
+
+// Moves TOTAL bytes between the file range at OFFSET and the iovec array with one
+// preadv/pwritev per run of consecutive blocks (a memcpy per slice on a mapped image).
+// The chain must already cover the range. LAST_BLOCK, if given, is set to the block
+// holding the last byte moved. Returns the number of bytes moved.
+int vec_transfer(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total,
+                 bool write, int* last_block) {
+    struct iovec* slices = malloc(sizeof(struct iovec) * iovcnt);
+    int done = 0;
+    int index = offset / BLOCK_SIZE;
+    int last_index = (offset + total - 1) / BLOCK_SIZE;
+    while (done < total) {
+        int block = chain_block_at(node, fdt, index, 0);
+        if (block == -1) {
+            break;
+        }
+        int blocks = 1;
+        while (index + blocks <= last_index && chain_block_at(node, fdt, index + blocks, 0) == block + blocks) {
+            blocks++;
+        }
+        int start = offset + done;
+        int64_t run_end = (int64_t) (index + blocks) * BLOCK_SIZE;
+        int len = (run_end < offset + total ? run_end : offset + total) - start;
+        int in_block = start - index * BLOCK_SIZE;
+        int count = iov_slice(iov, iovcnt, done, len, slices);
+
+        ssize_t moved;
+        if (FAT_DATA) {
+            char* at = block_data(block) + in_block;
+            for (int i = 0; i < count; i++) {
+                if (write) {
+                    memcpy(at, slices[i].iov_base, slices[i].iov_len);
+                } else {
+                    memcpy(slices[i].iov_base, at, slices[i].iov_len);
+                }
+                at += slices[i].iov_len;
+            }
+            moved = len;
+        } else {
+            // the image must hold the latest bytes of the run, and written blocks must not stay cached
+            if (cache_write_back_run(block, blocks) < 0) {
+                break;
+            }
+            off_t image_off = data_block_offset(block) + in_block;
+            if (write) {
+                for (int i = 0; i < blocks; i++) {
+                    cache_drop(block + i);
+                }
+                moved = pwritev(FS_FD, slices, count, image_off);
+            } else {
+                moved = preadv(FS_FD, slices, count, image_off);
+            }
+            if (moved < 0) {
+                perror(write ? "Error writing data blocks" : "Error reading data blocks");
+                break;
+            }
+        }
+        if (moved > 0 && last_block) {
+            *last_block = block + (in_block + moved - 1) / BLOCK_SIZE;
+        }
+        done += moved;
+        if (moved < len) {
+            break;
+        }
+        index += blocks;
+    }
+    free(slices);
+    return done;
+}
+
+// readv counterpart of read_at_offset: copies up to TOTAL bytes at OFFSET into the
+// iovec array. Returns the number of bytes read, 0 at EOF.
+int readv_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total) {
+    DirectoryEntry* entry = &node->entry;
+    if (offset < 0) {
+        return -1;
+    }
+    if (offset >= entry->size || total == 0) {
+        return 0;
+    }
+    if (total > entry->size - offset) {
+        total = entry->size - offset;
+    }
+    if (total >= DIRECT_READ_BYTES) {
+        return vec_transfer(node, fdt, offset, iov, iovcnt, total, false, NULL);
+    }
+    // small reads go through the cache, one buffer at a time
+    int done = 0;
+    for (int i = 0; i < iovcnt && done < total; i++) {
+        int want = total - done < (int) iov[i].iov_len ? total - done : (int) iov[i].iov_len;
+        int got = read_at_offset(node, fdt, offset + done, iov[i].iov_base, want);
+        if (got < 0) {
+            return done > 0 ? done : -1;
+        }
+        done += got;
+        if (got < want) {
+            break;
+        }
+    }
+    return done;
+}
+
+// writev counterpart of write_at_offset: writes the TOTAL bytes of the iovec array at
+// OFFSET, extending the file as needed. Returns the number of bytes written.
+int writev_at_offset(RootIndexNode* node, FDTEntry* fdt, int offset, const struct iovec* iov, int iovcnt, int total) {
+    DirectoryEntry* entry = &node->entry;
+    if (offset < 0 || total < 0) {
+        return -1;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    if (iovcnt == 1) {
+        return write_at_offset(node, fdt, offset, iov[0].iov_base, total);
+    }
+    if (total < DIRECT_WRITE_BYTES) {
+        // small writes are gathered and go through the cache as one
+        char* data = malloc(total);
+        int at = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(data + at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
+        }
+        int written = write_at_offset(node, fdt, offset, data, total);
+        free(data);
+        return written;
+    }
+
+    if (offset > entry->size && fill_hole(node, fdt, offset) < 0) {
+        return -1;
+    }
+    // reserve the whole range as extents first; a full file system leaves a short write
+    if (chain_block_at(node, fdt, (offset + total - 1) / BLOCK_SIZE, 1) == -1) {
+        perror("File system full");
+    }
+    int last_block = 0;
+    int done = vec_transfer(node, fdt, offset, iov, iovcnt, total, true, &last_block);
+    if (done == 0) {
+        return -1;
+    }
+
+    // size, tail and mtime are persisted once per call
+    if (offset + done >= entry->size) {
+        entry->size = offset + done;
+        set_entry_tail(entry, last_block);
+    }
+    entry->mtime = time(NULL);
+    write_entry_to_root(entry);
+    return done;
+}
+
+// Drops all of a file's blocks and resets it to size 0 (keeps the directory entry)
+int truncate_file(RootIndexNode* node) {
+    DirectoryEntry* entry = &node->entry;
+    int block = entry_first_block(entry);
+    while (block != FAT_END && block != 0) {
+        int next_block = fat_get(block);
+        free_block(block);
+        block = next_block;
+    }
+    set_entry_first_block(entry, FAT_END);
+    entry->size = 0;
+    entry->mtime = time(NULL);
+    node->chain_gen = ++CHAIN_GEN;
+    return write_entry_to_root(entry);
+}
+
+// builds the bitmap from FAT_TABLE (0 = free); block 0 and the root block are never free
+void free_map_build() {
+    free_map_destroy();
+    int num_blocks = DATA_REGION_SIZE / BLOCK_SIZE + 1;
+    if (num_blocks > NUM_FAT_ENTRIES) {
+        num_blocks = NUM_FAT_ENTRIES;
+    }
+    FREE_MAP.num_blocks = num_blocks;
+    FREE_MAP.num_words = (num_blocks + 63) / 64;
+    FREE_MAP.words = calloc(FREE_MAP.num_words, sizeof(uint64_t));
+    FREE_MAP.cursor = 2;
+    FREE_MAP.num_free = 0;
+
+    for (int i = 0; i < num_blocks; i++) {
+        if (i < 2 || fat_get(i) != 0) {
+            FREE_MAP.words[i / 64] |= (uint64_t) 1 << (i % 64);
+        } else {
+            FREE_MAP.num_free++;
+        }
+    }
+    // bits past the last block stay set so the scan never returns them
+    for (int i = num_blocks; i < FREE_MAP.num_words * 64; i++) {
+        FREE_MAP.words[i / 64] |= (uint64_t) 1 << (i % 64);
+    }
+}
+
+void free_map_destroy() {
+    free(FREE_MAP.words);
+    memset(&FREE_MAP, 0, sizeof(FreeMap));
+}
+
+// Next-fit allocation: scans a 64-bit word at a time from the roving cursor.
+// The returned block is marked in use and terminated (FAT entry = 0xFFFF).
+// Returns -1 if the file system is full.
+int alloc_block() {
+    if (FREE_MAP.num_free <= 0) {
+        // blocks freed by queued operations become reusable once they are committed
+        journal_commit();
+    }
+    if (FREE_MAP.num_free <= 0) {
+        return -1;
+    }
+    int start_word = FREE_MAP.cursor / 64;
+    for (int n = 0; n <= FREE_MAP.num_words; n++) {
+        int w = (start_word + n) % FREE_MAP.num_words;
+        uint64_t free_bits = ~FREE_MAP.words[w];
+        if (n == 0) {
+            // ignore bits behind the cursor on the first pass
+            free_bits &= ~(uint64_t) 0 << (FREE_MAP.cursor % 64);
+        }
+        if (free_bits == 0) {
+            continue;
+        }
+        int block = w * 64 + __builtin_ctzll(free_bits);
+        FREE_MAP.words[w] |= (uint64_t) 1 << (block % 64);
+        FREE_MAP.num_free--;
+        FREE_MAP.cursor = block + 1 < FREE_MAP.num_blocks ? block + 1 : 2;
+        fat_set(block, FAT_END);
+        return block;
+    }
+    return -1;
+}
+
+bool block_is_free(int block) {
+    return !(FREE_MAP.words[block / 64] & ((uint64_t) 1 << (block % 64)));
+}
+
+// Extent allocation: hands out a run of up to `want` contiguous blocks.
+// The run starting at `hint` is taken if that block is free (so a chain grows in place),
+// otherwise the first run of `want` blocks from the roving cursor, or the longest run seen.
+// The run is marked in use and chained in order (last block = 0xFFFF); *got is its length.
+// Returns the first block, or -1 if the file system is full.
+int alloc_extent(int hint, int want, int* got) {
+    *got = 0;
+    if (FREE_MAP.num_free < want) {
+        // blocks freed by queued operations become reusable once they are committed
+        journal_commit();
+    }
+    if (FREE_MAP.num_free <= 0 || want <= 0) {
+        return -1;
+    }
+    if (want > FREE_MAP.num_free) {
+        want = FREE_MAP.num_free;
+    }
+
+    int start = -1;
+    int len = 0;
+    if (hint >= 2 && hint < FREE_MAP.num_blocks && block_is_free(hint)) {
+        start = hint;
+        while (len < want && start + len < FREE_MAP.num_blocks && block_is_free(start + len)) {
+            len++;
+        }
+    } else {
+        int run_start = 0;
+        int run_len = 0;
+        int block = FREE_MAP.cursor;
+        for (int scanned = 0; scanned < FREE_MAP.num_blocks && len < want; ) {
+            if (block >= FREE_MAP.num_blocks) {
+                // runs do not wrap around the end of the data region
+                block = 0;
+                run_len = 0;
+            }
+            if (block % 64 == 0 && FREE_MAP.words[block / 64] == ~(uint64_t) 0) {
+                // skip fully used words
+                run_len = 0;
+                block += 64;
+                scanned += 64;
+                continue;
+            }
+            if (block_is_free(block)) {
+                if (run_len == 0) {
+                    run_start = block;
+                }
+                run_len++;
+                if (run_len > len) {
+                    start = run_start;
+                    len = run_len;
+                }
+            } else {
+                run_len = 0;
+            }
+            block++;
+            scanned++;
+        }
+    }
+    if (start == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        int block = start + i;
+        FREE_MAP.words[block / 64] |= (uint64_t) 1 << (block % 64);
+        fat_set(block, i + 1 < len ? block + 1 : FAT_END);
+    }
+    FREE_MAP.num_free -= len;
+    FREE_MAP.cursor = start + len < FREE_MAP.num_blocks ? start + len : 2;
+    *got = len;
+    return start;
+}
+
+// returns a block to the free pool and clears its FAT entry
+void free_block(int block) {
+    if (block < 2 || block >= FREE_MAP.num_blocks) {
+        return;
+    }
+    fat_set(block, 0);
+    cache_drop(block);
+    // while journaling the block stays reserved until the free is committed,
+    // so an uncommitted delete can never have its blocks overwritten
+    if (!JOURNAL.active) {
+        free_map_release(block);
+    }
+}
+
+// clears a block's bit in the free-block bitmap
+void free_map_release(int block) {
+    if (block < 2 || block >= FREE_MAP.num_blocks) {
+        return;
+    }
+    uint64_t bit = (uint64_t) 1 << (block % 64);
+    if (FREE_MAP.words[block / 64] & bit) {
+        FREE_MAP.words[block / 64] &= ~bit;
+        FREE_MAP.num_free++;
+    }
+}
+
+bool journal_read_header(int fs_fd, off_t offset, JournalHeader* header) {
+    if (pread(fs_fd, header, sizeof(JournalHeader), offset) != sizeof(JournalHeader)) {
+        return false;
+    }
+    return header->magic == JOURNAL_MAGIC && header->size == JOURNAL_SIZE;
+}
+
+// Replays the records committed since the last checkpoint, then starts journaling.
+// Called at mount once the FAT is mapped and blocks can be read.
+void journal_open(off_t offset, uint32_t next_seq) {
+    memset(&JOURNAL, 0, sizeof(Journal));
+    JOURNAL.offset = offset;
+    JOURNAL.capacity = JOURNAL_SIZE - JOURNAL_HEADER_SIZE;
+    JOURNAL.seq = next_seq;
+
+    char* log = malloc(JOURNAL.capacity);
+    if (log && pread(FS_FD, log, JOURNAL.capacity, offset + JOURNAL_HEADER_SIZE) == JOURNAL.capacity) {
+        int replayed = journal_apply(log, JOURNAL.capacity, next_seq, true);
+        if (replayed > 0) {
+            JOURNAL.seq += replayed;
+            // the replayed state is now home, so the log can start over
+            journal_checkpoint();
+        }
+    }
+    free(log);
+    JOURNAL.active = true;
+}
+
+// commits everything and checkpoints, so the image is complete without the log
+void journal_close() {
+    if (!JOURNAL.active) {
+        return;
+    }
+    journal_sync();
+    journal_checkpoint();
+    free(JOURNAL.fats);
+    free(JOURNAL.dirs);
+    free(JOURNAL.batch);
+    memset(&JOURNAL, 0, sizeof(Journal));
+}
+
+// Marks the start of a metadata operation (touch, rm, f_write, ...). Everything logged
+// since the previous call is closed as one record, and the batch is committed once
+// it is large enough. Callers are always at a consistent point when they call this.
+// Threads writing different files share operations, but every update is made under
+// ALLOC_LOCK and leaves the metadata consistent, so a record never holds half of one.
+void journal_begin() {
+    if (!JOURNAL.active) {
+        return;
+    }
+    pthread_mutex_lock(&ALLOC_LOCK);
+    journal_close_op();
+    if (JOURNAL.batch_len >= JOURNAL_BATCH_BYTES || JOURNAL.batch_ops >= JOURNAL_BATCH_OPS) {
+        journal_commit();
+    }
+    pthread_mutex_unlock(&ALLOC_LOCK);
+}
+
+// closes the operation in progress and commits the batch, e.g. before reading directory blocks
+void journal_sync() {
+    if (!JOURNAL.active) {
+        return;
+    }
+    pthread_mutex_lock(&ALLOC_LOCK);
+    journal_close_op();
+    journal_commit();
+    pthread_mutex_unlock(&ALLOC_LOCK);
+}
+
+void journal_log_fat(int block, int value) {
+    if (JOURNAL.num_fats == JOURNAL.cap_fats) {
+        int cap = JOURNAL.cap_fats ? JOURNAL.cap_fats * 2 : 64;
+        JournalFat* fats = realloc(JOURNAL.fats, sizeof(JournalFat) * cap);
+        if (!fats) {
+            // the update still reaches the FAT, just not through the log
+            perror("Error growing journal");
+            return;
+        }
+        JOURNAL.fats = fats;
+        JOURNAL.cap_fats = cap;
+    }
+    JournalFat* update = &JOURNAL.fats[JOURNAL.num_fats++];
+    update->block = block;
+    update->value = value == FAT_END ? 0xFFFFFFFF : (uint32_t) value;
+}
+
+// Writes a directory slot (or, with a NULL entry, zeroes the whole block).
+// While journaling the write is logged and only reaches the block once committed.
+void dir_write(int block, int slot, const DirectoryEntry* entry) {
+    if (!JOURNAL.active) {
+        dir_apply(block, entry ? (uint32_t) slot : JOURNAL_CLEAR_BLOCK, entry);
+        return;
+    }
+    if (JOURNAL.num_dirs == JOURNAL.cap_dirs) {
+        int cap = JOURNAL.cap_dirs ? JOURNAL.cap_dirs * 2 : 8;
+        JournalDir* dirs = realloc(JOURNAL.dirs, sizeof(JournalDir) * cap);
+        if (!dirs) {
+            // no room to log it: write the slot home directly (not atomic)
+            perror("Error growing journal");
+            dir_apply(block, entry ? (uint32_t) slot : JOURNAL_CLEAR_BLOCK, entry);
+            return;
+        }
+        JOURNAL.dirs = dirs;
+        JOURNAL.cap_dirs = cap;
+    }
+    JournalDir* update = &JOURNAL.dirs[JOURNAL.num_dirs++];
+    memset(update, 0, sizeof(JournalDir));
+    update->block = block;
+    update->slot = entry ? (uint32_t) slot : JOURNAL_CLEAR_BLOCK;
+    if (entry) {
+        memcpy(&update->entry, entry, sizeof(DirectoryEntry));
+    }
+}
+
+void dir_apply(int block, uint32_t slot, const DirectoryEntry* entry) {
+    if (slot == JOURNAL_CLEAR_BLOCK) {
+        char* zeros = calloc(1, BLOCK_SIZE);
+        cache_write_fresh(block, zeros, BLOCK_SIZE);
+        free(zeros);
+        return;
+    }
+    cache_write(block, slot * sizeof(DirectoryEntry), (const char*) entry, sizeof(DirectoryEntry));
+}
+
+uint32_t journal_checksum(const JournalRecord* record) {
+    JournalRecord copy = *record;
+    copy.checksum = 0;
+    size_t len = (size_t) record->num_fats * sizeof(JournalFat) + (size_t) record->num_dirs * sizeof(JournalDir);
+    uint32_t hash = 2166136261u;
+    const unsigned char* p = (const unsigned char*) &copy;
+    for (size_t i = 0; i < sizeof(JournalRecord); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    p = (const unsigned char*) (record + 1);
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// moves the operation in progress into the batch as one record
+void journal_close_op() {
+    if (JOURNAL.num_fats == 0 && JOURNAL.num_dirs == 0) {
+        return;
+    }
+    int len = sizeof(JournalRecord) + JOURNAL.num_fats * sizeof(JournalFat) + JOURNAL.num_dirs * sizeof(JournalDir);
+    if (JOURNAL.head + JOURNAL.batch_len + len > JOURNAL.capacity) {
+        journal_commit();
+    }
+    if (JOURNAL.head + len <= JOURNAL.capacity && JOURNAL.batch_len + len > JOURNAL.batch_cap) {
+        int cap = JOURNAL.batch_len + len > 2 * JOURNAL.batch_cap ? JOURNAL.batch_len + len : 2 * JOURNAL.batch_cap;
+        char* batch = realloc(JOURNAL.batch, cap);
+        if (batch) {
+            JOURNAL.batch = batch;
+            JOURNAL.batch_cap = cap;
+        } else {
+            perror("Error growing journal");
+        }
+    }
+    if (JOURNAL.head + len > JOURNAL.capacity || JOURNAL.batch_len + len > JOURNAL.batch_cap) {
+        // too big for the log even after a checkpoint, or no memory to batch it:
+        // write it home directly (not atomic)
+        for (int i = 0; i < JOURNAL.num_dirs; i++) {
+            dir_apply(JOURNAL.dirs[i].block, JOURNAL.dirs[i].slot, &JOURNAL.dirs[i].entry);
+        }
+        for (int i = 0; i < JOURNAL.num_fats; i++) {
+            if (JOURNAL.fats[i].value == 0) {
+                free_map_release(JOURNAL.fats[i].block);
+            }
+        }
+        JOURNAL.num_fats = 0;
+        JOURNAL.num_dirs = 0;
+        journal_checkpoint();
+        return;
+    }
+
+    JournalRecord* record = (JournalRecord*) (JOURNAL.batch + JOURNAL.batch_len);
+    memset(record, 0, sizeof(JournalRecord));
+    record->magic = JOURNAL_RECORD_MAGIC;
+    record->seq = JOURNAL.seq++;
+    record->num_fats = JOURNAL.num_fats;
+    record->num_dirs = JOURNAL.num_dirs;
+    char* payload = (char*) (record + 1);
+    if (JOURNAL.num_fats) {
+        memcpy(payload, JOURNAL.fats, JOURNAL.num_fats * sizeof(JournalFat));
+    }
+    if (JOURNAL.num_dirs) {
+        memcpy(payload + JOURNAL.num_fats * sizeof(JournalFat), JOURNAL.dirs, JOURNAL.num_dirs * sizeof(JournalDir));
+    }
+    record->checksum = journal_checksum(record);
+
+    JOURNAL.batch_len += len;
+    JOURNAL.batch_ops++;
+    JOURNAL.num_fats = 0;
+    JOURNAL.num_dirs = 0;
+}
+
+// Group commit: the whole batch goes to the log with one write and one flush,
+// then its directory slots are written home and its freed blocks become reusable.
+// Dirty data blocks are written back and flushed first, so the sizes and chains in
+// the batch never reach blocks still holding older contents after a crash.
+void journal_commit() {
+    if (!JOURNAL.active || JOURNAL.batch_len == 0) {
+        return;
+    }
+    cache_flush();
+    if (DATA_MAP && msync(DATA_MAP, DATA_MAP_SIZE, MS_SYNC) == -1) {
+        perror("Error writing data blocks");
+        return;
+    }
+    if (fdatasync(FS_FD) == -1) {
+        perror("Error writing data blocks");
+        return;
+    }
+    off_t at = JOURNAL.offset + JOURNAL_HEADER_SIZE + JOURNAL.head;
+    if (pwrite(FS_FD, JOURNAL.batch, JOURNAL.batch_len, at) != JOURNAL.batch_len || fdatasync(FS_FD) == -1) {
+        perror("Error writing journal");
+        return;
+    }
+    journal_apply(JOURNAL.batch, JOURNAL.batch_len, JOURNAL.seq - JOURNAL.batch_ops, false);
+    JOURNAL.head += JOURNAL.batch_len;
+    JOURNAL.batch_len = 0;
+    JOURNAL.batch_ops = 0;
+
+    // checkpoint early so a single operation always finds room in the log;
+    // never with an operation half done, since the checkpoint writes the whole FAT
+    if (JOURNAL.head > JOURNAL.capacity / 2 && JOURNAL.num_fats == 0 && JOURNAL.num_dirs == 0) {
+        journal_checkpoint();
+    }
+}
+
+// Writes the dirty FAT pages and every dirty block home, then empties the log
+void journal_checkpoint() {
+    fat_flush();
+    cache_flush();
+    if (DATA_MAP) {
+        msync(DATA_MAP, DATA_MAP_SIZE, MS_SYNC);
+    }
+    fdatasync(FS_FD);
+
+    // records below next_seq are ignored from now on; this must be durable
+    // before the log is overwritten from the start
+    char header[JOURNAL_HEADER_SIZE] = {0};
+    JournalHeader* h = (JournalHeader*) header;
+    h->magic = JOURNAL_MAGIC;
+    h->size = JOURNAL_SIZE;
+    h->next_seq = JOURNAL.seq;
+    pwrite(FS_FD, header, JOURNAL_HEADER_SIZE, JOURNAL.offset);
+    fdatasync(FS_FD);
+    JOURNAL.head = 0;
+}
+
+// Applies consecutive records starting at sequence number first_seq.
+// On replay the FAT updates are applied too and records are checked; otherwise
+// (after a commit) the FAT is already up to date and freed blocks are released.
+// Returns the number of records applied.
+int journal_apply(const char* buf, int len, uint32_t first_seq, bool replay) {
+    int pos = 0;
+    int count = 0;
+    uint32_t seq = first_seq;
+    while (pos + (int) sizeof(JournalRecord) <= len) {
+        const JournalRecord* record = (const JournalRecord*) (buf + pos);
+        if (record->magic != JOURNAL_RECORD_MAGIC || record->seq != seq) {
+            break;
+        }
+        int64_t record_len = sizeof(JournalRecord) + (int64_t) record->num_fats * sizeof(JournalFat)
+            + (int64_t) record->num_dirs * sizeof(JournalDir);
+        if (pos + record_len > len || (replay && journal_checksum(record) != record->checksum)) {
+            break;
+        }
+        const JournalFat* fats = (const JournalFat*) (record + 1);
+        const JournalDir* dirs = (const JournalDir*) (fats + record->num_fats);
+        for (uint32_t i = 0; i < record->num_fats; i++) {
+            if (fats[i].block >= (uint32_t) NUM_FAT_ENTRIES) {
+                continue;
+            }
+            if (replay) {
+                fat_set(fats[i].block, fats[i].value == 0xFFFFFFFF ? FAT_END : (int) fats[i].value);
+            } else if (fats[i].value == 0) {
+                free_map_release(fats[i].block);
+            }
+        }
+        for (uint32_t i = 0; i < record->num_dirs; i++) {
+            if (dirs[i].block >= 1 && dirs[i].block < (uint32_t) NUM_FAT_ENTRIES) {
+                dir_apply(dirs[i].block, dirs[i].slot, &dirs[i].entry);
+            }
+        }
+        pos += record_len;
+        seq++;
+        count++;
     }
-    // Allocate a buffer to hold the file content
-    char* buffer = (char*) calloc(1, file_size + 1);  // +1 for null terminator
-    if (buffer == NULL) {
-        perror("Error allocating memory for file content");
-        return NULL;
+    return count;
+}
+
+// takes DIR_LOCK for the calling thread unless it already holds it
+// (a nested exclusive request under a shared hold keeps the shared hold)
+void dir_lock(bool exclusive) {
+    if (DIR_LOCK_DEPTH++ > 0) {
+        return;
+    }
+    if (exclusive) {
+        pthread_rwlock_wrlock(&DIR_LOCK);
+    } else {
+        pthread_rwlock_rdlock(&DIR_LOCK);
+    }
+    DIR_LOCK_EXCLUSIVE = exclusive;
+}
+
+// turns the outermost shared hold into an exclusive one; the lock is dropped in between,
+// so anything found under the shared hold has to be looked up again
+void dir_lock_upgrade() {
+    if (DIR_LOCK_EXCLUSIVE || DIR_LOCK_DEPTH != 1) {
+        return;
+    }
+    pthread_rwlock_unlock(&DIR_LOCK);
+    pthread_rwlock_wrlock(&DIR_LOCK);
+    DIR_LOCK_EXCLUSIVE = true;
+}
+
+void dir_unlock() {
+    if (--DIR_LOCK_DEPTH == 0) {
+        pthread_rwlock_unlock(&DIR_LOCK);
+        DIR_LOCK_EXCLUSIVE = false;
+    }
+}
+
+int delete_from_penn_fat(const char *filename) {
+    // See if file currently exists by iterating through root directory
+    DirectoryEntry* entry = get_entry_from_root(filename, true, NULL);
+    if (!entry) {
+        perror("Source file does not exist");
+        return 0;
+    }
+
+    // Delete file from fat table if it does exist
+    int block = entry_first_block(entry);
+    // char nullChar = '\0';
+    while (block != FAT_END && block != 0) {
+        int next_block = fat_get(block);
+        free_block(block);
+        // lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block - 1)), SEEK_SET);
+        // write(fs_fd, &nullChar, sizeof(char));
+        block = next_block;
     }
-    // Seek back to the beginning of the file
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        perror("Error seeking to beginning of file");
-        free(buffer);
+
+    // write updated FAT table to file
+    // lseek(fs_fd, 0, SEEK_SET);
+    // ssize_t num = write(fs_fd, FAT_TABLE, TABLE_REGION_SIZE);
+    // printf("%zd", num);
+
+    // Delete entry from root directory
+    free(delete_entry_from_root(filename));
+    free(entry);
+    return 0;
+}
+
+DirectoryEntry* get_entry_from_root(const char *filename, bool update_first_block, char* rename_to) {
+    // Lookup is a single probe into the in-memory index built at mount
+    RootIndexNode* node = root_index_find(filename);
+    if (!node) {
         return NULL;
     }
-    // Read the entire file content into the buffer
-    ssize_t bytes_read = read(fd, buffer, file_size);
-    if (bytes_read == -1) {
-        perror("Error reading file content");
-        free(buffer);
+
+    DirectoryEntry* read_struct = &node->entry;
+    if (update_first_block && entry_first_block(read_struct) == FAT_END) {
+        int block = alloc_block();
+        if (block == -1) {
+            perror("File system full");
+            return NULL;
+        }
+        set_entry_first_block(read_struct, block);
+        read_struct->mtime = time(NULL);
+        dir_write(node->block, node->slot, read_struct);
+    }
+    if (rename_to != NULL) {
+        // unlink under the old name and re-insert under the new one
+        int block = node->block;
+        int slot = node->slot;
+        DirectoryEntry renamed = node->entry;
+        root_index_remove(node);
+        strncpy(renamed.name, rename_to, MAX_FILENAME_LENGTH);
+        renamed.mtime = time(NULL);
+        node = root_index_insert(&renamed, block, slot);
+
+        dir_write(block, slot, &node->entry);
+    }
+
+    // callers own the returned copy
+    DirectoryEntry* copy = malloc(sizeof(DirectoryEntry));
+    if (copy) {
+        memcpy(copy, &node->entry, sizeof(DirectoryEntry));
+    }
+    return copy;
+}
+
+DirectoryEntry* delete_entry_from_root(const char *filename) {
+    RootIndexNode* node = root_index_find(filename);
+    if (!node) {
         return NULL;
     }
-    // Null-terminate the string
-    buffer[bytes_read] = '\0';
-    return buffer;
+
+    // make name empty string on disk so the slot can be reused
+    DirectoryEntry* read_struct = malloc(sizeof(DirectoryEntry));
+    memcpy(read_struct, &node->entry, sizeof(DirectoryEntry));
+    read_struct->name[0] = '\0';
+
+    dir_write(node->block, node->slot, read_struct);
+
+    root_index_push_free(node->block, node->slot);
+    root_index_remove(node);
+    return read_struct;
+}
+
+int add_entry_to_root(DirectoryEntry* entry) {
+    int block = 0;
+    int slot = 0;
+
+    // Reuse an empty or deleted slot if the index knows of one
+    if (!root_index_pop_free(&block, &slot)) {
+        // If no space, add another block to the root's FAT chain
+        int last_block = 1;
+        while (fat_get(last_block) != FAT_END) {
+            last_block = fat_get(last_block);
+        }
+        int new_final_block = alloc_block();
+        if (new_final_block == -1) {
+            return -1;
+        }
+        // update FAT table with new block
+        fat_set(last_block, new_final_block);
+
+        // clear the new root block so stale data is not read back as entries
+        dir_write(new_final_block, 0, NULL);
+
+        int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
+        for (int i = num_entries - 1; i > 0; i--) {
+            root_index_push_free(new_final_block, i);
+        }
+        block = new_final_block;
+        slot = 0;
+    }
+
+    // write entry to root
+    dir_write(block, slot, entry);
+
+    root_index_insert(entry, block, slot);
+    return 0;
+}
+
+int touch(const char *filename) {
+    dir_lock(true);
+    int ret = touch_locked(filename);
+    dir_unlock();
+    return ret;
+}
+
+int touch_locked(const char *filename) {
+    journal_begin();
+    if (strlen(filename) > MAX_FILENAME_LENGTH) {
+        perror("Error: filename too long");
+        return -1;
+    }
+    if (filename[0] == '\0') {
+        perror("Error: filename cannot be empty");
+        return -1;
+    }
+    if (filename[0] == '.' || filename[0] == '/' || filename[0] == '\\' || filename[0] == ':') {
+        perror("Error: filename cannot start with ', /, \\, or :'");
+        return -1;
+    }
+    // See if file currently exists by iterating through root directory
+    DirectoryEntry* entry = get_entry_from_root(filename, false, NULL);
+    if (entry) {
+        // printf("Found entry for file in touch\n");
+        entry->mtime = time(NULL);
+        write_entry_to_root(entry);
+        free(entry);
+        return 0;
+    }
+
+    // Create file if it does not exist
+    entry = calloc(1, sizeof(DirectoryEntry));
+    strcpy(entry->name, filename);
+    entry->size = 0;
+    set_entry_first_block(entry, FAT_END); // firstBlock is undefined (null) when size = 0
+    entry->type = 1; // TODO: is how do we set type
+    entry->perm = 7; // TODO: is how do we set perm
+    entry->mtime = time(NULL); // set time to now TODO: is this correct function call?
+
+    // Save pointer at the end of root entries block
+    if (add_entry_to_root(entry) == -1) {
+        perror("Error: no empty entries in root directory");
+        return -1;
+    }
+    // printf("TOUCH %s\n", entry->name);
+    // f_ls(NULL);
+    free(entry);
+    return 0;
+}
+
+int rm(const char *filename) {
+    dir_lock(true);
+    int ret = rm_locked(filename);
+    dir_unlock();
+    return ret;
+}
+
+int rm_locked(const char *filename) {
+    journal_begin();
+    // See if file currently exists by iterating through root directory
+    DirectoryEntry* entry = get_entry_from_root(filename, false, NULL);
+    if (!entry) {
+        perror("Source file does not exist");
+        return 0;
+    }
+    free(entry);
+    fdt_drop_name(filename);
+    delete_from_penn_fat(filename);
+    // // Delete file from fat table if it does exist
+    // int block = entry->firstBlock;
+    // while (block != 0xFFFF && block != 0) {
+    //     int next_block = FAT_TABLE[block];
+    //     FAT_TABLE[block] = 0;
+    //     block = next_block;
+    // }
+
+    // // Delete entry from root directory
+    // delete_entry_from_root(filename);
+    return 0;
+}
+
+int mv(const char *source, const char *dest) {
+    dir_lock(true);
+    int ret = mv_locked(source, dest);
+    dir_unlock();
+    return ret;
 }
 
+int mv_locked(const char *source, const char *dest) {
+    journal_begin();
+    // TODO: add function to validate name
+
+    // See if file currently exists by iterating through root directory
+    DirectoryEntry* entry = get_entry_from_root(source, false, NULL);
+    if (!entry) {
+        perror("Error: source file does not exist");
+        return -1;
+    }
+    free(entry);
+    // buffered writes belong to the file being renamed, not to a new file under the old name
+    fdt_flush_name(source);
+    // delete dest file
+    rm(dest);
+    // rename
+    entry = get_entry_from_root(source, false, (char*) dest);
+    free(entry);
+
+    return 0;
+}
 
 // TODO: parse args in shell
 int cp(const char *source, const char *dest, int s_host, int d_host) {
+    dir_lock(true);
+    journal_begin();
+    if (!s_host) {
+        fdt_flush_name(source);
+    }
     if (d_host) { // dest is in host
         cp_to_h(source, dest);
     } else if (s_host) { // source is in host
@@ -750,251 +2570,470 @@ int cp(const char *source, const char *dest, int s_host, int d_host) {
     } else { // both are in FAT
         cp_helper(source, dest);
     }
+    dir_unlock();
     return 0;
 }
 
 int cp_helper(const char *source, const char *dest) {
 
     // both in fat
-    
-    int fs_fd = open(FS_NAME, O_RDWR);
-
-    // find source file
-    // open file
-    DirectoryEntry* entry = get_entry_from_root(source, true, NULL);
-
-    if (entry == NULL) {
+    if (!root_index_find(source)) {
         perror("Error: source file does not exist");
         return -1;
     }
+    if (strcmp(source, dest) == 0) {
+        return 0;
+    }
 
-    DirectoryEntry* d_entry = get_entry_from_root(dest, true, NULL);
-    if (d_entry) {
-        delete_from_penn_fat(dest);
-        // delete_entry_from_root(dest);
+    int r_fd = f_open((char *) source, F_READ);
+    // f_open truncates (or creates) the destination
+    int w_fd = f_open((char *) dest, F_WRITE);
+    if (r_fd < 0 || w_fd < 0) {
+        if (r_fd >= 0) f_close(r_fd);
+        if (w_fd >= 0) f_close(w_fd);
+        return -1;
     }
-    // create new file with name
-    touch(dest);
 
-    d_entry = get_entry_from_root(dest, true, NULL);
+    // reserve the whole destination up front so it is laid out contiguously
+    RootIndexNode* src = root_index_find(source);
+    if (src && src->entry.size > 0) {
+        f_fallocate(w_fd, src->entry.size);
+    }
 
-    int* chain = get_fat_chain(entry->firstBlock);
-    int w_fd = f_open((char *) dest, F_WRITE);
-    int chars = entry->size;
-    for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
-        if (!chain[i]) {
+    // copy block by block
+    char* txt = malloc(sizeof(char) * BLOCK_SIZE);
+    int bytes_read;
+    while ((bytes_read = f_read(r_fd, BLOCK_SIZE, txt)) > 0) {
+        if (f_write(w_fd, txt, bytes_read) != bytes_read) {
             break;
         }
-
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (chain[i] - 1)), SEEK_SET);
-        char* txt = malloc(sizeof(char) * BLOCK_SIZE);
-        read(fs_fd, txt, sizeof(char) * BLOCK_SIZE);
-        // write to file
-        f_write(w_fd, txt, sizeof(char) * BLOCK_SIZE);
-
-        // if (chars <= 0) {
-        //     break;
-        // }
-        // lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (chain[i] - 1)), SEEK_SET);
-        // char* txt = NULL;
-        // int size = 0;
-        // // either size of block or size of file text
-        // if (chars >= BLOCK_SIZE) {
-        //     size = BLOCK_SIZE;
-        //     chars -= BLOCK_SIZE;
-        // } else {
-        //     size = chars;
-        //     chars = 0;
-        // }
-
-        // txt = calloc(1, sizeof(char) * size);
-        // read(fs_fd, txt, sizeof(char) * size);
-        // if (i == 0) {
-        //     f_write(w_fd, txt, sizeof(char) * size);
-        //     write(1, "WRITING\n", sizeof(char) * strlen("WRITING\n"));
-        // } else {
-        //     append_to_penn_fat(txt, entry->firstBlock, sizeof(char) * size);
-        // }
     }
+    free(txt);
+    f_close(r_fd);
     f_close(w_fd);
-    // write(1, "writing to root\n", sizeof(char) * strlen("writing to root\n"));
-    d_entry->size = entry->size;
-    // printf("CHARS %i\n", d_entry->size);
-    write_entry_to_root(d_entry);
     return 0;
 }
 
-int cp_from_h(const char *source, const char *dest) {
-    // copy from host file
+// Copies len bytes from in_fd at in_off to out_fd at out_off without passing
+// them through a user-space buffer: copy_file_range, then sendfile when the
+// two files cannot share it, then pread/pwrite as a last resort. Returns the
+// number of bytes copied, which is short only at the end of in_fd, or -1.
+int64_t host_copy_range(int out_fd, off_t out_off, int in_fd, off_t in_off, int64_t len) {
+    int64_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, len - done, 0);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == 0) {
+            return done;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+            perror("Error copying file range");
+            return -1;
+        }
+        break;
+    }
+
+    // sendfile writes at out_fd's file position; nothing else uses the image's position
+    if (done < len && lseek(out_fd, out_off, SEEK_SET) != -1) {
+        while (done < len) {
+            ssize_t n = sendfile(out_fd, in_fd, &in_off, len - done);
+            if (n > 0) {
+                done += n;
+                out_off += n;
+                continue;
+            }
+            if (n == 0) {
+                return done;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EINVAL && errno != ENOSYS) {
+                perror("Error copying file range");
+                return -1;
+            }
+            break;
+        }
+    }
+
+    if (done < len) {
+        char* buf = malloc(COPY_CHUNK);
+        while (done < len) {
+            int64_t want = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
+            ssize_t got = pread(in_fd, buf, want, in_off);
+            if (got <= 0) {
+                if (got == -1) {
+                    perror("Error copying file range");
+                    done = -1;
+                }
+                break;
+            }
+            if (pwrite(out_fd, buf, got, out_off) != got) {
+                perror("Error copying file range");
+                done = -1;
+                break;
+            }
+            in_off += got;
+            out_off += got;
+            done += got;
+        }
+        free(buf);
+    }
+    return done;
+}
+
+// Moves the first size bytes of the chain at first_block to or from the host
+// file host_fd, merging consecutive blocks into one range per copy. Blocks
+// going to the host are written back from the cache first; blocks coming from
+// the host are dropped from it. Returns the number of bytes moved; last_block,
+// if not NULL, gets the block holding the last byte moved (0 if none was).
+int64_t copy_file_runs(int first_block, int64_t size, int host_fd, bool to_host, int* last_block) {
+    if (last_block) {
+        *last_block = 0;
+    }
+    int64_t done = 0;
+    int block = first_block;
+    while (done < size && block != FAT_END && block != 0) {
+        int run_start = block;
+        int run_len = 0;
+        while (block != FAT_END && block != 0 && block == run_start + run_len
+               && (int64_t) run_len * BLOCK_SIZE < size - done) {
+            run_len++;
+            block = fat_get(block);
+        }
+        int64_t len = (int64_t) run_len * BLOCK_SIZE;
+        if (len > size - done) {
+            len = size - done;
+        }
+
+        off_t image_off = data_block_offset(run_start);
+        int64_t n;
+        if (to_host) {
+            if (!FAT_DATA && cache_write_back_run(run_start, run_len) < 0) {
+                break;
+            }
+            posix_fadvise(FS_FD, image_off, len, POSIX_FADV_WILLNEED);
+            n = host_copy_range(host_fd, done, FS_FD, image_off, len);
+        } else {
+            // drop first so a stale dirty copy cannot be written over the new data later
+            for (int i = 0; i < run_len; i++) {
+                cache_drop(run_start + i);
+            }
+            n = host_copy_range(FS_FD, image_off, host_fd, done, len);
+        }
+        if (n > 0) {
+            done += n;
+            if (last_block) {
+                *last_block = run_start + (int) ((n - 1) / BLOCK_SIZE);
+            }
+        }
+        if (n < len) {
+            break;
+        }
+    }
+    return done;
+}
 
-    // open host file to read
-    int h_fd = open(source, O_RDWR);
+// Copies a host file into the image. A regular file is reserved up front with
+// f_fallocate, so it is laid out contiguously, and then each run of consecutive
+// blocks is filled by host_copy_range: copy_file_range, then sendfile, then
+// pread/pwrite, with no pass through a user-space buffer unless both fail.
+// Pipes and devices have no size to reserve and are streamed through f_write
+// HOST_COPY_CHUNK bytes at a time.
+int cp_from_h(const char *source, const char *dest) {
+    int h_fd = open(source, O_RDONLY);
     if (h_fd == -1) {
         perror("Error opening file");
-        exit(1);
+        return -1;
     }
-
-    // check if file exists in fat, remove if it does
-    DirectoryEntry* entry = get_entry_from_root(dest, true, NULL);
-    // write(1, "entry checked\n", sizeof(char)*strlen("entry checked\n"));
-    if (entry) {
-        delete_from_penn_fat(dest);
-        // delete_entry_from_root(dest);
+    struct stat st;
+    if (fstat(h_fd, &st) == -1) {
+        perror("Error reading host file size");
+        close(h_fd);
+        return -1;
     }
-    // write(1, "entry checked\n", sizeof(char)*strlen("entry checked\n"));
-    // create new file with name
-    touch(dest);
-    entry = get_entry_from_root(dest, true, NULL);
+    posix_fadvise(h_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // f_open truncates (or creates) the destination
     int w_fd = f_open((char *) dest, F_WRITE);
-    // TODO: update directory entry with the first block of file
-    char* txt = read_file_to_string(h_fd);
-    printf("%s\n", txt);
-    f_write(w_fd, txt, sizeof(char) * strlen(txt));
-    // int i = find_first_free_block();
-    // append_to_penn_fat(txt, i, BLOCK_SIZE);
+    if (w_fd < 0) {
+        close(h_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    if (S_ISREG(st.st_mode)) {
+        // regular files go straight into their preallocated blocks
+        // when the image fills up, whatever part of the file did fit is kept
+        RootIndexNode* node = root_index_find(dest);
+        if (st.st_size > INT32_MAX) {
+            fprintf(stderr, "Error: %s is too large for the file system\n", source);
+            ret = -1;
+        } else if (st.st_size > 0) {
+            f_fallocate(w_fd, st.st_size);
+        }
+        if (ret == 0 && node) {
+            int tail;
+            int64_t copied = copy_file_runs(entry_first_block(&node->entry), st.st_size, h_fd, false, &tail);
+            node->entry.size = copied;
+            set_entry_tail(&node->entry, tail);
+            node->entry.mtime = time(NULL);
+            write_entry_to_root(&node->entry);
+            if (copied != st.st_size) {
+                fprintf(stderr, "Error: copied %lld of %lld bytes from %s\n",
+                        (long long) copied, (long long) st.st_size, source);
+                ret = -1;
+            }
+        }
+    } else {
+        // pipes and devices have no size to preallocate, stream them instead
+        char* buf = malloc(HOST_COPY_CHUNK);
+        ssize_t bytes_read;
+        while ((bytes_read = read(h_fd, buf, HOST_COPY_CHUNK)) > 0) {
+            if (f_write(w_fd, buf, bytes_read) != bytes_read) {
+                ret = -1;
+                break;
+            }
+        }
+        if (bytes_read == -1) {
+            perror("Error reading host file");
+            ret = -1;
+        }
+        free(buf);
+    }
     f_close(w_fd);
-    // entry->size = strlen(txt);
-    // write_entry_to_root(entry);
-    return 0;
+    close(h_fd);
+    return ret;
 }
 
 // copying from fat to host
 int cp_to_h(const char *source, const char *dest) {
-    // write(1, "helper\n", sizeof(char) * strlen("helper\n"));
-    // open fat binary
-    int fs_fd = open(FS_NAME, O_RDWR);
-    if (fs_fd == -1) {
-        perror("Error opening file system image");
-        exit(1);
-    }
-
-    // write(1, "fd got\n", sizeof(char) * strlen("fd got\n"));
-    // get directory entry for file
-    DirectoryEntry* entry = get_entry_from_root(source, true, NULL);
-    if (!entry) {
+    RootIndexNode* node = root_index_find(source);
+    if (!node) {
         perror("Error: source file does not exist");
         return -1;
     }
 
-    // write(1, "entry\n", sizeof(char) * strlen("entry\n"));
-
-    // file chain
-    int* chain = get_fat_chain(entry->firstBlock);
-    // write(1, "chain\n", sizeof(char) * strlen("chain\n"));
-
-    // open host file
-    int h_fd = open(dest, O_RDWR | O_CREAT, 0666);
-    int chars = entry->size;
-    // write(1, "host opened\n", sizeof(char) * strlen("host opened\n"));
-    for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
-        // write(1, chain[i], sizeof(int));
-        if (!chain[i] || chain[i] == 0) {
-            break;
-        }
-        // copy block into host file
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (chain[i] - 1)), SEEK_SET);
-        char* txt = malloc(sizeof(char) * BLOCK_SIZE);
-        read(fs_fd, txt, sizeof(char) * BLOCK_SIZE);
-        write(h_fd, txt, sizeof(char) * strlen(txt));
-
-        // // copy block into host file
-        // char* txt = NULL;
-        // int size = 0;
-        // // either size of block or size of file text
-        // if (chars >= BLOCK_SIZE) {
-        //     size = BLOCK_SIZE;
-        //     chars -= BLOCK_SIZE;
-        // } else {
-        //     size = chars;
-        //     chars = 0;
-        // }
-
-        // txt = malloc(sizeof(char) * size);
-        // lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (chain[i] - 1)), SEEK_SET);
-        // read(fs_fd, txt, sizeof(char) * size);
-        // printf("%s\n", txt);
-        // write(h_fd, txt, sizeof(char) * size);
-        // printf("SIZE %i\n", size);
-
-        
-    }
-    free(chain);
-    close(fs_fd);
+    int h_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (h_fd == -1) {
+        perror("Error opening host file");
+        return -1;
+    }
+    int64_t size = node->entry.size;
+    int64_t copied = copy_file_runs(entry_first_block(&node->entry), size, h_fd, true, NULL);
     close(h_fd);
+    if (copied != size) {
+        fprintf(stderr, "Error: copied %lld of %lld bytes to %s\n", (long long) copied, (long long) size, dest);
+        return -1;
+    }
     return 0;
 }
 
 int f_lseek(int fd, int offset, int whence) {
+    dir_lock(false);
+    int ret = f_lseek_locked(fd, offset, whence);
+    dir_unlock();
+    return ret;
+}
 
-    off_t new_position;
+int f_lseek_locked(int fd, int offset, int whence) {
+    // Check if file descriptor is valid
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
+        return -1;
+    }
 
-    int blocks = offset / BLOCK_SIZE;
-    int rem = offset % BLOCK_SIZE;
+    // buffered writes land first, so F_SEEK_END sees them
+    if (fdt_flush(fd) < 0) {
+        return -1;
+    }
 
-    // find entry name
+    // offsets are byte positions within the file, not within the image
     FDTEntry* fdtEntry = FDT[fd];
-    int current_position = fdtEntry->offset;
-
-    DirectoryEntry* entry = get_entry_from_root(fdtEntry->name, false, NULL);
-    int* chain = get_fat_chain(entry->firstBlock);
-
-    // current offset from beginning of root directory
-    int root_offset = current_position - TABLE_REGION_SIZE;
-    // block number of current file pointer
-    int curr_block = root_offset / BLOCK_SIZE;
-    // offset value of end of current block
-    int end_block = TABLE_REGION_SIZE + ((curr_block + 1)*BLOCK_SIZE);
-    // number of bytes between file pointer and end of block
-    int block_leftover = end_block - current_position;
-    
-    int block = entry->firstBlock;
-    int last_block = block;
+    RootIndexNode* node = NULL;
+    if (whence == F_SEEK_END) {
+        node = root_index_find(fdtEntry->name);
+        if (!node) {
+            perror("Error: source file does not exist");
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&fdtEntry->lock);
+    int new_position = 0;
     switch (whence) {
         case F_SEEK_SET:
-            new_position = TABLE_REGION_SIZE + (BLOCK_SIZE * (chain[blocks]-1)) + rem;
+            new_position = offset;
             break;
         case F_SEEK_CUR:
-            
-            // shift is within same block
-            if (offset < block_leftover) {
-                new_position = current_position + offset;
-            } else {
-                // shift to different block
-                offset -= block_leftover;
-                int num_blocks = offset / BLOCK_SIZE;
-                int rem_block = offset % BLOCK_SIZE;
-                new_position = TABLE_REGION_SIZE + (BLOCK_SIZE * chain[num_blocks + curr_block]) + rem_block;
-            }
-            
+            new_position = fdtEntry->offset + offset;
             break;
         case F_SEEK_END:
-            // TODO: need to actually store the current position somewhere
-            while (block != 0xFFFF) {
-                last_block = block;
-                block = FAT_TABLE[block];
-            }
-            // last_block is the last file block
-            new_position = TABLE_REGION_SIZE + (BLOCK_SIZE * last_block) + offset;
-
-            // printf("New file offset: %ld\n", (long)new_position);
-            break;  // Success
+            pthread_rwlock_rdlock(&node->lock);
+            new_position = node->entry.size + offset;
+            pthread_rwlock_unlock(&node->lock);
+            break;
         default:
+            pthread_mutex_unlock(&fdtEntry->lock);
             fprintf(stderr, "Invalid 'whence' parameter\n");
             return -1;  // Error
     }
+    if (new_position < 0) {
+        pthread_mutex_unlock(&fdtEntry->lock);
+        fprintf(stderr, "Invalid offset\n");
+        return -1;
+    }
 
     // update file pointer position that's stored to = new_position
     fdtEntry->offset = new_position;
+    pthread_mutex_unlock(&fdtEntry->lock);
+    return 0;
+}
+
+// counts the contiguous runs (and, in num_blocks, the blocks) of a chain
+int chain_runs(int first_block, int* num_blocks) {
+    int runs = 0;
+    int blocks = 0;
+    int block = first_block;
+    int prev = -1;
+    while (block != FAT_END && block != 0) {
+        if (block != prev + 1) {
+            runs++;
+        }
+        blocks++;
+        prev = block;
+        block = fat_get(block);
+    }
+    if (num_blocks) {
+        *num_blocks = blocks;
+    }
+    return runs;
+}
+
+// Moves a file's chain into one contiguous extent. Without compact only fragmented
+// chains move; with compact the lowest free run that fits is taken if it starts
+// before the current first block. Returns 1 if the file moved, 0 if not.
+int relocate_chain(RootIndexNode* node, bool compact) {
+    journal_begin();
+    DirectoryEntry* entry = &node->entry;
+    int len = 0;
+    int runs = chain_runs(entry_first_block(entry), &len);
+    if (len == 0 || (runs == 1 && !compact)) {
+        return 0;
+    }
+    if (compact) {
+        // first fit from the start of the data region
+        FREE_MAP.cursor = 2;
+    }
+    int got;
+    int start = alloc_extent(-1, len, &got);
+    if (start == -1) {
+        return 0;
+    }
+    if (got < len || (runs == 1 && start > entry_first_block(entry))) {
+        // no better place for it, give the run back
+        for (int i = 0; i < got; i++) {
+            free_block(start + i);
+        }
+        return 0;
+    }
+
+    // copy each block across
+    char* buf = malloc(BLOCK_SIZE);
+    int block = entry_first_block(entry);
+    for (int i = 0; i < len; i++) {
+        cache_read(block, 0, buf, BLOCK_SIZE);
+        cache_write_fresh(start + i, buf, BLOCK_SIZE);
+        block = fat_get(block);
+    }
+    free(buf);
+
+    // the copy must be on disk before the journal can commit the switch to it,
+    // or a replay after a crash points the file at blocks never written
+    if (JOURNAL.active && (data_sync_run(start, len) < 0 || fdatasync(FS_FD) == -1)) {
+        perror("Error writing relocated blocks");
+        for (int i = 0; i < len; i++) {
+            free_block(start + i);
+        }
+        return 0;
+    }
+
+    // then release the old chain
+    block = entry_first_block(entry);
+    for (int i = 0; i < len; i++) {
+        int next_block = fat_get(block);
+        free_block(block);
+        block = next_block;
+    }
+
+    set_entry_first_block(entry, start);
+    set_entry_tail(entry, start + (entry->size - 1) / BLOCK_SIZE);
+    node->chain_gen = ++CHAIN_GEN;
+    write_entry_to_root(entry);
+    return 1;
+}
+
+int compare_first_block(const void* a, const void* b) {
+    RootIndexNode* x = *(RootIndexNode**) a;
+    RootIndexNode* y = *(RootIndexNode**) b;
+    return entry_first_block(&x->entry) - entry_first_block(&y->entry);
+}
+
+int defrag(bool compact) {
+    if (FS_FD == -1) {
+        perror("Error: no file system mounted");
+        return -1;
+    }
+
+    dir_lock(true);
+    // collect the files, lowest first block first so compaction fills from the front
+    RootIndexNode** nodes = malloc(sizeof(RootIndexNode*) * (ROOT_INDEX.count > 0 ? ROOT_INDEX.count : 1));
+    int num_nodes = 0;
+    for (int i = 0; i < ROOT_INDEX.num_buckets; i++) {
+        for (RootIndexNode* node = ROOT_INDEX.buckets[i]; node; node = node->next) {
+            nodes[num_nodes++] = node;
+        }
+    }
+    qsort(nodes, num_nodes, sizeof(RootIndexNode*), compare_first_block);
+
+    int files = 0;
+    int runs_before = 0;
+    int moved = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        int runs = chain_runs(entry_first_block(&nodes[i]->entry), NULL);
+        if (runs > 0) {
+            files++;
+            runs_before += runs;
+        }
+        moved += relocate_chain(nodes[i], compact);
+    }
+    int runs_after = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        runs_after += chain_runs(entry_first_block(&nodes[i]->entry), NULL);
+    }
+    free(nodes);
+    dir_unlock();
+
+    printf("defrag: %d files, %d moved, runs per file %.2f -> %.2f\n", files, moved,
+        files ? (double) runs_before / files : 0.0, files ? (double) runs_after / files : 0.0);
     return 0;
 }
 
 void f_ls(const char *filename) {
+    dir_lock(true);
+    // directory blocks only hold committed entries
+    journal_sync();
+
     // iterate through directory entries
     // print file names 
 
     // open file
     // FILE * file_ptr = fopen(FS_NAME, "r");
-    int fs_fd = open(FS_NAME, O_RDWR);
     // if (fs_fd == -1) {
     //     perror("Error opening file system image");
     //     exit(1);
@@ -1004,6 +3043,7 @@ void f_ls(const char *filename) {
     int* root_chain = get_fat_chain(1);
     // max number of directory entry structs in the block
     int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
+    DirectoryEntry* buf = malloc(BLOCK_SIZE);
 
     for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
         if (!root_chain[i]) {
@@ -1011,11 +3051,16 @@ void f_ls(const char *filename) {
         }
         // printf("%i\n", root_chain[i]);
         // position file pointer
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE* (root_chain[i] - 1)), SEEK_SET);
+        // scan the mapped block in place, or copy it out of the cache once per block
+        DirectoryEntry* entries = (DirectoryEntry*) block_data(root_chain[i]);
+        if (!entries) {
+            entries = buf;
+            if (cache_read(root_chain[i], 0, (char*) entries, BLOCK_SIZE) != BLOCK_SIZE) {
+                continue;
+            }
+        }
         for (int i = 0; i < num_entries; i++) {
-            DirectoryEntry* read_struct = calloc(1, sizeof(DirectoryEntry));
-            // fread(&read_struct, sizeof(read_struct), 1, file_ptr);
-            read(fs_fd, read_struct, sizeof(DirectoryEntry));
+            DirectoryEntry* read_struct = &entries[i];
             // directory entry was not deleted (non empty name)
             // if (read_struct == NULL) {
             //     printf("NULL found\n");
@@ -1023,10 +3068,15 @@ void f_ls(const char *filename) {
             // }
             // printf("%s", read_struct->name);
             // if (strcmp(read_struct->name, "") != 0) {
+            if (read_struct->name[0] == 0 || read_struct->name[0] == 1 || read_struct->name[0] == 2) {
+                continue;
+            }
             struct tm *localTime = localtime(&read_struct->mtime);
-            char formattedTime[50];
+            char formattedTime[50] = "";
             // strftime(formattedTime, sizeof(formattedTime), "%B %d %H:%M", read_struct->mtime);
-            strftime(formattedTime, sizeof(formattedTime), "%b %d %H:%M", localTime);
+            if (localTime) {
+                strftime(formattedTime, sizeof(formattedTime), "%b %d %H:%M", localTime);
+            }
 
             // perm string
             char* perm = NULL;
@@ -1043,312 +3093,850 @@ void f_ls(const char *filename) {
             } else if (read_struct->perm == 7) {
                 perm = "xrw";
             }
-            if (read_struct->name[0] != 0 && read_struct->name[0] != '\0') {
-                printf("%hu %s %u %s %s\n", read_struct->firstBlock, perm, 
-                read_struct->size, formattedTime, read_struct->name);
+            // empty files show the on-disk end-of-chain marker
+            uint32_t first_block = (uint32_t) entry_first_block(read_struct);
+            if (FAT_ENTRY_SIZE == 2) {
+                first_block &= 0xFFFF;
             }
+            printf("%u %s %u %s %.*s\n", first_block, perm, 
+                read_struct->size, formattedTime, MAX_FILENAME_LENGTH, read_struct->name);
             // (long long) read_struct->mtime
         }
     }
     free(root_chain);
-    close(fs_fd);
+    free(buf);
+    dir_unlock();
+}
+
+// Double buffer between cat's reader (the calling thread) and its writer thread:
+// one half is filled while the other is drained to the output.
+typedef struct CatPipe {
+    char* buf[2];
+    int len[2];
+    bool full[2];
+    bool done;                  // the reader has queued its last chunk
+    int error;                  // set by the writer; later chunks are dropped
+    int out_fd;                 // FDT descriptor, or -1 for stdout
+    pennfat_fs* fs;             // file system the caller is working in
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} CatPipe;
+
+// Drains full halves of the pipe in order until the reader is done. The writer
+// works under the caller's exclusive DIR_LOCK, which is held until it is joined.
+void* cat_writer(void* arg) {
+    CatPipe* cat_pipe = arg;
+    CURRENT_FS = cat_pipe->fs;
+    DIR_LOCK_DEPTH = 1;
+    DIR_LOCK_EXCLUSIVE = true;
+    int i = 0;
+    while (true) {
+        pthread_mutex_lock(&cat_pipe->lock);
+        while (!cat_pipe->full[i] && !cat_pipe->done) {
+            pthread_cond_wait(&cat_pipe->cond, &cat_pipe->lock);
+        }
+        if (!cat_pipe->full[i]) {
+            pthread_mutex_unlock(&cat_pipe->lock);
+            break;
+        }
+        bool failed = cat_pipe->error;
+        pthread_mutex_unlock(&cat_pipe->lock);
+
+        int written = 0;
+        while (!failed && written < cat_pipe->len[i]) {
+            int n;
+            if (cat_pipe->out_fd < 0) {
+                n = write(STDOUT_FILENO, cat_pipe->buf[i] + written, cat_pipe->len[i] - written);
+                if (n == -1) {
+                    perror("Error writing to stdout");
+                }
+            } else {
+                n = f_write_locked(cat_pipe->out_fd, cat_pipe->buf[i] + written, cat_pipe->len[i] - written);
+            }
+            if (n <= 0) {
+                failed = true;
+            } else {
+                written += n;
+            }
+        }
+
+        pthread_mutex_lock(&cat_pipe->lock);
+        cat_pipe->error = failed;
+        cat_pipe->full[i] = false;
+        pthread_cond_broadcast(&cat_pipe->cond);
+        pthread_mutex_unlock(&cat_pipe->lock);
+        i ^= 1;
+    }
+    DIR_LOCK_DEPTH = 0;
+    return NULL;
 }
 
 int cat(const char **files, int num_files, const char *output_file, int append) {
+    dir_lock(true);
+    int ret = cat_locked(files, num_files, output_file, append);
+    dir_unlock();
+    return ret;
+}
+
+int cat_locked(const char **files, int num_files, const char *output_file, int append) {
+    journal_begin();
     // Note should support:
     // cat FILE ... [ -w OUTPUT_FILE ]: (set output_file to null if stdout) Concatenates the files and prints them to stdout by default, or overwrites OUTPUT_FILE. If OUTPUT_FILE does not exist, it will be created. (Same for OUTPUT_FILE in the commands below.)
     // cat FILE ... [ -a OUTPUT_FILE ]: (set output_file to null if stdout) Concatenates the files and prints them to stdout by default, or appends to OUTPUT_FILE.
     // cat -w OUTPUT_FILE: (set num_files to 0) Reads from the terminal and overwrites OUTPUT_FILE.
     // cat -a OUTPUT_FILE: (set num_files to 0) Reads from the terminal and appends to OUTPUT_FILE.
-    
-    // Step 1: Get input data (as a string)
-    char* data = calloc(1, 4096);
-    int chars_added = 0;
-    if (num_files > 0) {
-        // Concatenate files
-        for (int i = 0; i < num_files; i++) {
-            // Get directory entry for file
-            DirectoryEntry* entry = get_entry_from_root(files[i], true, NULL);
-            if (!entry) {
-                perror("Error: source file does not exist");
-                return -1;
-            }
-            // Get new file data and append it to current data
-            chars_added += strcat_data(data, entry->firstBlock);
-            // write(1, "strcat called\n", sizeof(char) * strlen("strcat called\n"));
+
+    // Step 1: check every source before the output is touched
+    for (int i = 0; i < num_files; i++) {
+        if (!root_index_find(files[i])) {
+            perror("Error: source file does not exist");
+            return -1;
         }
-    } else {
-        // Read from terminal
-        int num_bytes = read(STDIN_FILENO, data, 4096);
-        if (num_bytes == -1) {
-            perror("Error reading from terminal");
+        if (output_file && !append && strcmp(files[i], output_file) == 0) {
+            fprintf(stderr, "cat: %s: input file is output file\n", files[i]);
             return -1;
         }
-        chars_added += num_bytes;
     }
-    uint32_t stored_size = 0;
-    int fs_fd = open(FS_NAME, O_RDWR);
-    // Step 2: Output data
+
+    // Step 2: open the output (F_WRITE truncates, both modes create the file)
+    int out_fd = -1;
     if (output_file) {
-        // Write to file
-        DirectoryEntry* entry = get_entry_from_root(output_file, true, NULL);
-        if (append) {
-            if (!entry) {
-                // Create file if it does not exist
-                if (touch(output_file) < 0) {
-                    perror("cat - Error creating file using touch");
-                    return -1;
-                }
-                entry = get_entry_from_root(output_file, true, NULL);
-                if (!entry) {
-                    perror("cat - Error creating file using touch (entry still null)");
-                    return -1;
+        out_fd = f_open_locked((char *) output_file, append ? F_APPEND : F_WRITE);
+        if (out_fd < 0) {
+            perror("cat - Error opening output file");
+            return -1;
+        }
+    }
+
+    // Step 3: open every source and record its size before the writer starts. Opening
+    // can grow the FDT and flush the output's buffer, so none of it may happen while the
+    // writer is using the output; a source that is also the output is copied as it was
+    // before anything was appended to it.
+    int ret = 0;
+    int* in_fds = malloc(sizeof(int) * (num_files > 0 ? num_files : 1));
+    int64_t* sizes = malloc(sizeof(int64_t) * (num_files > 0 ? num_files : 1));
+    int opened = 0;
+    for (; opened < num_files; opened++) {
+        in_fds[opened] = f_open_locked((char *) files[opened], F_READ);
+        if (in_fds[opened] < 0) {
+            ret = -1;
+            break;
+        }
+        sizes[opened] = root_index_find(files[opened])->entry.size;
+    }
+
+    // Step 4: stream the input through the double buffer
+    CatPipe cat_pipe = {.out_fd = out_fd, .fs = CURRENT_FS};
+    cat_pipe.buf[0] = malloc(CAT_CHUNK);
+    cat_pipe.buf[1] = malloc(CAT_CHUNK);
+    pthread_mutex_init(&cat_pipe.lock, NULL);
+    pthread_cond_init(&cat_pipe.cond, NULL);
+    pthread_t writer;
+    pthread_create(&writer, NULL, cat_writer, &cat_pipe);
+
+    int cur = 0;
+    int file = 0;
+    while (ret == 0) {
+        if (num_files > 0 && file == num_files) {
+            break;
+        }
+
+        pthread_mutex_lock(&cat_pipe.lock);
+        while (cat_pipe.full[cur]) {
+            pthread_cond_wait(&cat_pipe.cond, &cat_pipe.lock);
+        }
+        bool failed = cat_pipe.error;
+        pthread_mutex_unlock(&cat_pipe.lock);
+        if (failed) {
+            ret = -1;
+            break;
+        }
+
+        int n;
+        if (num_files > 0) {
+            int want = sizes[file] < CAT_CHUNK ? sizes[file] : CAT_CHUNK;
+            n = want > 0 ? f_read_locked(in_fds[file], want, cat_pipe.buf[cur]) : 0;
+            if (n <= 0) {
+                if (n < 0) {
+                    ret = -1;
                 }
+                file++;
+                continue;
             }
-            stored_size = entry->size;
+            sizes[file] -= n;
         } else {
-            if (entry) {
-                // Delete old file from penn fat if it exists and recreate it
-                if (delete_from_penn_fat(output_file) < 0) {
-                    perror("cat - Error deleting file cannot write properly, exiting");
-                    return -1;
-                }
+            // Read from terminal until EOF
+            n = read(STDIN_FILENO, cat_pipe.buf[cur], CAT_CHUNK);
+            if (n == -1) {
+                perror("Error reading from terminal");
+                ret = -1;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&cat_pipe.lock);
+        cat_pipe.len[cur] = n;
+        cat_pipe.full[cur] = true;
+        pthread_cond_broadcast(&cat_pipe.cond);
+        pthread_mutex_unlock(&cat_pipe.lock);
+        cur ^= 1;
+    }
+
+    pthread_mutex_lock(&cat_pipe.lock);
+    cat_pipe.done = true;
+    pthread_cond_broadcast(&cat_pipe.cond);
+    pthread_mutex_unlock(&cat_pipe.lock);
+    pthread_join(writer, NULL);
+    if (cat_pipe.error) {
+        ret = -1;
+    }
+
+    pthread_cond_destroy(&cat_pipe.cond);
+    pthread_mutex_destroy(&cat_pipe.lock);
+    free(cat_pipe.buf[0]);
+    free(cat_pipe.buf[1]);
+    for (int i = 0; i < opened; i++) {
+        f_close_locked(in_fds[i]);
+    }
+    free(in_fds);
+    free(sizes);
+    if (out_fd >= 0) {
+        f_close_locked(out_fd);
+    }
+    return ret;
+}
+
+// Doubles the descriptor table (starting at FDT_CHUNK descriptors) up to its limit, adding
+// pool chunks for the new entries and pushing the new descriptors on the free stack.
+// Returns -1 once the table cannot grow.
+int fdt_grow() {
+    // descriptors are not tied to the FAT size, so FAT32 keeps the FAT16 table size
+    int limit = NUM_FAT_ENTRIES < MAX_FAT_ENTRIES ? NUM_FAT_ENTRIES : MAX_FAT_ENTRIES;
+    int old_size = NUM_FDT_ENTRIES;
+    int new_size = old_size > 0 ? old_size * 2 : FDT_CHUNK;
+    if (new_size > limit) {
+        new_size = limit;
+    }
+    if (new_size <= old_size) {
+        return -1;
+    }
+
+    int old_chunks = (old_size + FDT_CHUNK - 1) / FDT_CHUNK;
+    int new_chunks = (new_size + FDT_CHUNK - 1) / FDT_CHUNK;
+    FDTEntry** table = realloc(FDT, sizeof(FDTEntry*) * new_size);
+    if (table) {
+        FDT = table;
+    }
+    FDTEntry** pool = realloc(FDT_POOL, sizeof(FDTEntry*) * new_chunks);
+    if (pool) {
+        FDT_POOL = pool;
+    }
+    int* free_stack = realloc(FDT_FREE, sizeof(int) * new_size);
+    if (free_stack) {
+        FDT_FREE = free_stack;
+    }
+    if (!table || !pool || !free_stack) {
+        return -1;
+    }
+    for (int i = old_chunks; i < new_chunks; i++) {
+        FDT_POOL[i] = calloc(FDT_CHUNK, sizeof(FDTEntry));
+        if (!FDT_POOL[i]) {
+            new_size = i * FDT_CHUNK;
+            break;
+        }
+    }
+    if (new_size <= old_size) {
+        return -1;
+    }
+
+    // the free stack is empty here, so pushing in reverse leaves the lowest descriptor on top
+    for (int fd = new_size - 1; fd >= old_size; fd--) {
+        FDT[fd] = NULL;
+        FDT_FREE[NUM_FDT_FREE++] = fd;
+    }
+    NUM_FDT_ENTRIES = new_size;
+    return 0;
+}
+
+void fdt_destroy() {
+    for (int fd = 0; fd < NUM_FDT_ENTRIES; fd++) {
+        if (FDT[fd]) {
+            chain_reset_cursor(FDT[fd]);
+            free(FDT[fd]->wbuf);
+            pthread_mutex_destroy(&FDT[fd]->lock);
+        }
+    }
+    for (int i = 0; i < (NUM_FDT_ENTRIES + FDT_CHUNK - 1) / FDT_CHUNK; i++) {
+        free(FDT_POOL[i]);
+    }
+    free(FDT_POOL);
+    free(FDT);
+    free(FDT_FREE);
+    FDT_POOL = NULL;
+    FDT = NULL;
+    FDT_FREE = NULL;
+    NUM_FDT_FREE = 0;
+    NUM_FDT_ENTRIES = 0;
+}
+
+/* F_* Function definitions */
+int f_open(char *fname, int mode) {
+    dir_lock(true);
+    int ret = f_open_locked(fname, mode);
+    dir_unlock();
+    return ret;
+}
+
+int f_open_locked(char *fname, int mode) {
+    journal_begin();
+    if(strlen(fname) > MAX_FILENAME_LENGTH) {
+        perror("Error: filename too long");
+        return -1;
+    }
+    // TODO: check name meets https://www.ibm.com/docs/en/zos/3.1.0?topic=locales-posix-portable-file-name-character-set
+
+    if (mode != F_WRITE && mode != F_READ && mode != F_APPEND) {
+        perror("Error: invalid mode");
+        return -1;
+    }
+
+    // Take the descriptor on top of the free stack, growing the table when it is empty;
+    // it is only popped once the open succeeds
+    if (NUM_FDT_FREE == 0 && fdt_grow() < 0) {
+        perror("Error: too many open files");
+        return -1;
+    }
+    int next_descriptor = FDT_FREE[NUM_FDT_FREE - 1];
+
+    // the new descriptor sees what other descriptors have written so far
+    fdt_flush_name(fname);
+    RootIndexNode* node = root_index_find(fname);
+    if (!node) {
+        if (mode == F_READ) {
+            perror("Error: file does not exist");
+            return -1;
+        }
+        // Create file if it does not exist
+        if (touch(fname) < 0) {
+            return -1;
+        }
+        node = root_index_find(fname);
+    } else if (mode == F_WRITE) {
+        // Truncate once here so that f_write never has to rebuild the file
+        truncate_file(node);
+    }
+
+    FDTEntry* fdtEntry = &FDT_POOL[next_descriptor / FDT_CHUNK][next_descriptor % FDT_CHUNK];
+    memset(fdtEntry, 0, sizeof(FDTEntry));
+    fdtEntry->mode = mode;
+    strcpy(fdtEntry->name, fname);
+    
+    fdtEntry->offset = mode == F_APPEND ? node->entry.size : 0;
+    chain_reset_cursor(fdtEntry);
+    fdtEntry->chain_gen = node->chain_gen;
+    pthread_mutex_init(&fdtEntry->lock, NULL);
+    FDT[next_descriptor] = fdtEntry;
+    NUM_FDT_FREE--;
+    node->open_count++;
+    // printf("[DEBUG] Created file descriptor %d, name: %s\n", next_descriptor, FDT[next_descriptor]->name);
+
+    return next_descriptor;
+}
+
+int f_read(int fd, int n, char *buf) {
+    dir_lock(false);
+    int ret = f_read_locked(fd, n, buf);
+    dir_unlock();
+    return ret;
+}
+
+int f_read_locked(int fd, int n, char *buf) {
+    // Check if file descriptor is valid
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES) {
+        perror("Error: invalid file descriptor");
+        return -1;
+    }
+    // Check if file is open
+    if (!FDT[fd]) {
+        perror("Error: file is not open");
+        return -1;
+    }
+    // Check if file is open for reading
+    if (FDT[fd]->mode != F_READ) {
+        perror("Error: file is not open for reading");
+        return -1;
+    }
+
+    if (n < 0 || (n > 0 && !buf)) {
+        perror("Error: invalid read buffer");
+        return -1;
+    }
+
+    // Get directory entry for file
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
+        perror("Error: source file does not exist");
+        return -1;
+    }
+
+    // Copy straight from the blocks under the file pointer into buf
+    FDTEntry* fdt = FDT[fd];
+    pthread_mutex_lock(&fdt->lock);
+    pthread_rwlock_rdlock(&node->lock);
+    fdt_readahead(node, fdt, fdt->offset, n);
+    int bytes_read = read_at_offset(node, fdt, fdt->offset, buf, n);
+    if (bytes_read > 0) {
+        fdt->offset += bytes_read;
+    }
+    fdt->ra_next = fdt->offset;
+    pthread_rwlock_unlock(&node->lock);
+    pthread_mutex_unlock(&fdt->lock);
+    if (bytes_read < 0) {
+        perror("Error: reading file data");
+        return -1;
+    }
+    // If we reach EOF return 0
+    return bytes_read;
+}
+
+int f_write(int fd, const char *str, int n) {
+    dir_lock(false);
+    int ret = f_write_locked(fd, str, n);
+    dir_unlock();
+    return ret;
+}
+
+int f_write_locked(int fd, const char *str, int n) {
+    // printf("[DEBUG] F_WRITE fd: %d, str: %s, n: %d\n", fd, str, n);
+    // Check if file descriptor is valid
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES) {
+        perror("Error: invalid file descriptor");
+        return -1;
+    }
+    // Check if file is open
+    if (!FDT[fd]) {
+        perror("Error: file is not open");
+        return -1;
+    }
+    // Check if file is open for writing
+    if (FDT[fd]->mode != F_WRITE && FDT[fd]->mode != F_APPEND) {
+        perror("Error: file is not open for writin or appending");
+        return -1;
+    }
+    if (n < 0 || (n > 0 && !str)) {
+        perror("Error: invalid write buffer");
+        return -1;
+    }
+
+    // small writes collect in the descriptor's buffer until it holds a block
+    FDTEntry* fdt = FDT[fd];
+    if (n < BLOCK_SIZE) {
+        while (true) {
+            pthread_mutex_lock(&fdt->lock);
+            if (fdt->wbuf_len == 0
+                || (fdt->offset == fdt->wbuf_offset + fdt->wbuf_len && fdt->wbuf_len + n <= BLOCK_SIZE)) {
+                break;
             }
-            if (touch(output_file) < 0) {
-                perror("cat - Error creating file using touch");
+            // not contiguous with the buffered bytes, or they would not fit
+            pthread_mutex_unlock(&fdt->lock);
+            if (fdt_flush(fd) < 0) {
                 return -1;
             }
         }
-        entry = get_entry_from_root(output_file, true, NULL); // Update entry value
-        int block = find_first_free_block();
-        if (block == -1) {
-            perror("File System full");
+        if (!fdt->wbuf) {
+            fdt->wbuf = malloc(BLOCK_SIZE);
+        }
+        if (fdt->wbuf_len == 0) {
+            fdt->wbuf_offset = fdt->offset;
+        }
+        memcpy(fdt->wbuf + fdt->wbuf_len, str, n);
+        fdt->wbuf_len += n;
+        fdt->offset += n;
+        bool full = fdt->wbuf_len == BLOCK_SIZE;
+        pthread_mutex_unlock(&fdt->lock);
+        if (full && fdt_flush(fd) < 0) {
             return -1;
         }
-        entry->firstBlock = block;
-        FAT_TABLE[block] = 0xFFFF;
-        lseek(fs_fd, block * 2, SEEK_SET);
-        write(fs_fd, &FAT_TABLE[block], 2);
-        entry->size = stored_size + chars_added;
-        write_entry_to_root(entry);
-        append_to_penn_fat(data, entry->firstBlock, chars_added, stored_size);
-        printf("ADDED: %i\n", chars_added);
-       
-    } else {
-        // Write to stdout
-        int num_bytes = write(STDOUT_FILENO, data, sizeof(char) * strlen(data));
-        if (num_bytes == -1) {
-            perror("Error writing to stdout");
+        return n;
+    }
+    if (fdt_flush(fd) < 0) {
+        return -1;
+    }
+    return fdt_write_through(fd, str, n, -1);
+}
+
+// Writes n bytes at file offset AT (-1 for the descriptor's offset, which then advances)
+// straight to the file. Appends always land at the current end of file.
+int fdt_write_through(int fd, const char *str, int n, int at) {
+    struct iovec iov = {.iov_base = (void *) str, .iov_len = n};
+    return fdt_writev_through(fd, &iov, 1, at);
+}
+
+// Vectored form of fdt_write_through.
+int fdt_writev_through(int fd, const struct iovec* iov, int iovcnt, int at) {
+    journal_begin();
+    int n = iov_total(iov, iovcnt);
+    // Get directory entry for file, creating it if it was removed while open
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
+        // recreating the entry changes the directory
+        dir_lock_upgrade();
+        if (!FDT[fd]) {
+            perror("Error: file is not open");
             return -1;
         }
+        node = root_index_find(FDT[fd]->name);
+    }
+    if (!node) {
+        if (touch(FDT[fd]->name) < 0) {
+            perror("f_write - Error creating file using touch");
+            return -1;
+        }
+        node = root_index_find(FDT[fd]->name);
+        if (!node) {
+            perror("f_write - Error creating file using touch (entry still null)");
+            return -1;
+        }
+    }
+
+    FDTEntry* fdt = FDT[fd];
+    pthread_mutex_lock(&fdt->lock);
+    pthread_rwlock_wrlock(&node->lock);
+    int pos = at >= 0 ? at : fdt->offset;
+    if (fdt->mode == F_APPEND) {
+        pos = node->entry.size;
+    }
+
+    int chars_added = writev_at_offset(node, fdt, pos, iov, iovcnt, n);
+    if (at < 0 && chars_added > 0) {
+        fdt->offset = pos + chars_added; // move the file pointer past the bytes written
+    }
+    pthread_rwlock_unlock(&node->lock);
+    pthread_mutex_unlock(&fdt->lock);
+    if (chars_added < 0) {
+        perror("f_write - Error writing to penn fat");
+        return -1;
+    }
+    return chars_added;
+}
+
+// Writes the descriptor's buffered small writes through to the file.
+int fdt_flush(int fd) {
+    FDTEntry* fdt = FDT[fd];
+    pthread_mutex_lock(&fdt->lock);
+    char* pending = fdt->wbuf;
+    int len = fdt->wbuf_len;
+    int at = fdt->wbuf_offset;
+    if (len == 0) {
+        pthread_mutex_unlock(&fdt->lock);
+        return 0;
+    }
+    fdt->wbuf = NULL;
+    fdt->wbuf_len = 0;
+    pthread_mutex_unlock(&fdt->lock);
+
+    int written = fdt_write_through(fd, pending, len, at);
+
+    // keep the buffer for the next small write
+    pthread_mutex_lock(&fdt->lock);
+    if (!fdt->wbuf) {
+        fdt->wbuf = pending;
+        pending = NULL;
+    }
+    pthread_mutex_unlock(&fdt->lock);
+    free(pending);
+    return written == len ? 0 : -1;
+}
+
+// Flushes every descriptor with buffered writes to FNAME, so the file can be read
+// through another descriptor or by name.
+void fdt_flush_name(const char *fname) {
+    RootIndexNode* node = root_index_find(fname);
+    if (!node || node->open_count == 0) {
+        return;
+    }
+    for (int fd = 0; fd < NUM_FDT_ENTRIES; fd++) {
+        if (FDT[fd] && FDT[fd]->wbuf_len > 0 && strcmp(FDT[fd]->name, fname) == 0) {
+            fdt_flush(fd);
+        }
     }
-    close(fs_fd);
-    return 0;
 }
 
-/* F_* Function definitions */
-int f_open(char *fname, int mode) {
-    if(strlen(fname) > MAX_FILENAME_LENGTH) {
-        perror("Error: filename too long");
-        return -1;
+// Discards buffered writes to FNAME, whose entry is being removed, so closing the
+// descriptors later does not bring the file back.
+void fdt_drop_name(const char *fname) {
+    RootIndexNode* node = root_index_find(fname);
+    if (!node || node->open_count == 0) {
+        return;
     }
-    // TODO: check name meets https://www.ibm.com/docs/en/zos/3.1.0?topic=locales-posix-portable-file-name-character-set
+    for (int fd = 0; fd < NUM_FDT_ENTRIES; fd++) {
+        if (FDT[fd] && FDT[fd]->wbuf_len > 0 && strcmp(FDT[fd]->name, fname) == 0) {
+            pthread_mutex_lock(&FDT[fd]->lock);
+            FDT[fd]->wbuf_len = 0;
+            pthread_mutex_unlock(&FDT[fd]->lock);
+        }
+    }
+}
 
-    // Get next_descriptor that's free and add entry to FDT
-    int next_descriptor = 0;
-    for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
-        if (!FDT[i]) {
-            next_descriptor = i;
-            break;
+int fdt_flush_all() {
+    int ret = 0;
+    for (int fd = 0; fd < NUM_FDT_ENTRIES; fd++) {
+        if (FDT[fd] && fdt_flush(fd) < 0) {
+            ret = -1;
         }
     }
-    FDTEntry* fdtEntry = calloc(1, sizeof(FDTEntry));
-    fdtEntry->mode = mode;
-    strcpy(fdtEntry->name, fname);
-    
-    fdtEntry->offset = 0;
-    FDT[next_descriptor] = fdtEntry;
-    // printf("[DEBUG] Created file descriptor %d, name: %s\n", next_descriptor, FDT[next_descriptor]->name);
+    return ret;
+}
 
-    return next_descriptor;
+int f_flush(int fd) {
+    dir_lock(false);
+    int ret = f_flush_locked(fd);
+    dir_unlock();
+    return ret;
 }
 
-int f_read(int fd, int n, char *buf) {
-    // Check if file descriptor is valid
-    if (fd < 0 || fd >= NUM_FAT_ENTRIES) {
+int f_flush_locked(int fd) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
         perror("Error: invalid file descriptor");
         return -1;
     }
-    // Check if file is open
-    if (!FDT[fd]) {
-        perror("Error: file is not open");
+    return fdt_flush(fd);
+}
+
+int f_pread(int fd, int n, char *buf, int offset) {
+    dir_lock(false);
+    int ret = f_pread_locked(fd, n, buf, offset);
+    dir_unlock();
+    return ret;
+}
+
+int f_pread_locked(int fd, int n, char *buf, int offset) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
         return -1;
     }
-    // Check if file is open for reading
     if (FDT[fd]->mode != F_READ) {
         perror("Error: file is not open for reading");
         return -1;
     }
-
-    // Get directory entry for file
-    DirectoryEntry* entry = get_entry_from_root(FDT[fd]->name, false, NULL);
-    if (!entry) {
+    if (n < 0 || (n > 0 && !buf) || offset < 0) {
+        perror("Error: invalid read buffer or offset");
+        return -1;
+    }
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
         perror("Error: source file does not exist");
         return -1;
     }
 
-    // Get file data
-    char* data = calloc(1, sizeof(char) * BLOCK_SIZE * NUM_FAT_ENTRIES);
-    strcat_data(data, entry->firstBlock);
+    // blocks are found with a cursor of our own, so the descriptor (and its lock) is
+    // left alone and concurrent calls only share the file's read lock
+    FDTEntry cursor = {.cursor_index = -1};
+    pthread_rwlock_rdlock(&node->lock);
+    cursor.chain_gen = node->chain_gen;
+    int bytes_read = read_at_offset(node, &cursor, offset, buf, n);
+    pthread_rwlock_unlock(&node->lock);
+    chain_reset_cursor(&cursor);
+    if (bytes_read < 0) {
+        perror("Error: reading file data");
+        return -1;
+    }
+    return bytes_read;
+}
 
-    // Copy data to buffer
-    strncpy(buf, data, n);
-    // write(STDOUT_FILENO, data, sizeof(char) * strlen(data));
-    free(data);
-    // If we reach EOF return 0
-    if (strlen(buf) * sizeof(char) < n) {
-        return 0;
+int f_pwrite(int fd, const char *str, int n, int offset) {
+    dir_lock(false);
+    int ret = f_pwrite_locked(fd, str, n, offset);
+    dir_unlock();
+    return ret;
+}
+
+int f_pwrite_locked(int fd, const char *str, int n, int offset) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
+        return -1;
+    }
+    if (FDT[fd]->mode != F_WRITE && FDT[fd]->mode != F_APPEND) {
+        perror("Error: file is not open for writing or appending");
+        return -1;
     }
-    return n;
+    if (n < 0 || (n > 0 && !str) || offset < 0) {
+        perror("Error: invalid write buffer or offset");
+        return -1;
+    }
+    // earlier buffered writes land first
+    if (fdt_flush(fd) < 0) {
+        return -1;
+    }
+    return fdt_write_through(fd, str, n, offset);
 }
 
-int f_write(int fd, const char *str, int n) {
-    // printf("[DEBUG] F_WRITE fd: %d, str: %s, n: %d\n", fd, str, n);
-    // Check if file descriptor is valid
-    if (fd < 0 || fd >= NUM_FAT_ENTRIES) {
+int f_readv(int fd, const struct iovec *iov, int iovcnt) {
+    dir_lock(false);
+    int ret = f_readv_locked(fd, iov, iovcnt);
+    dir_unlock();
+    return ret;
+}
+
+int f_readv_locked(int fd, const struct iovec *iov, int iovcnt) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
         perror("Error: invalid file descriptor");
         return -1;
     }
-    // Check if file is open
-    if (!FDT[fd]) {
-        perror("Error: file is not open");
+    if (FDT[fd]->mode != F_READ) {
+        perror("Error: file is not open for reading");
+        return -1;
+    }
+    int total = iov_total(iov, iovcnt);
+    if (total < 0) {
+        fprintf(stderr, "Error: invalid iovec array\n");
+        return -1;
+    }
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
+        perror("Error: source file does not exist");
+        return -1;
+    }
+
+    FDTEntry* fdt = FDT[fd];
+    pthread_mutex_lock(&fdt->lock);
+    pthread_rwlock_rdlock(&node->lock);
+    fdt_readahead(node, fdt, fdt->offset, total);
+    int bytes_read = readv_at_offset(node, fdt, fdt->offset, iov, iovcnt, total);
+    if (bytes_read > 0) {
+        fdt->offset += bytes_read;
+    }
+    fdt->ra_next = fdt->offset;
+    pthread_rwlock_unlock(&node->lock);
+    pthread_mutex_unlock(&fdt->lock);
+    if (bytes_read < 0) {
+        perror("Error: reading file data");
+        return -1;
+    }
+    return bytes_read;
+}
+
+int f_writev(int fd, const struct iovec *iov, int iovcnt) {
+    dir_lock(false);
+    int ret = f_writev_locked(fd, iov, iovcnt);
+    dir_unlock();
+    return ret;
+}
+
+int f_writev_locked(int fd, const struct iovec *iov, int iovcnt) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
         return -1;
     }
-    // Check if file is open for writing
     if (FDT[fd]->mode != F_WRITE && FDT[fd]->mode != F_APPEND) {
-        perror("Error: file is not open for writin or appending");
+        perror("Error: file is not open for writing or appending");
         return -1;
     }
-    int fs_fd = open(FS_NAME, O_RDWR);
-    // Get directory entry for file and write
-    DirectoryEntry* entry = get_entry_from_root(FDT[fd]->name, true, NULL);
-    // printf("ENTRY: %s\n", entry->name);
-    // write(STDOUT_FILENO, "ENTRY\n", sizeof(char) * strlen("ENTRY\n"));
-    char* data = calloc(1, sizeof(char) * BLOCK_SIZE * NUM_FAT_ENTRIES);
-    uint32_t stored_size = 0;
-    if (FDT[fd]->mode == F_APPEND) {
-        if (!entry) {
-            // Create file if it does not exist
-            if (touch(FDT[fd]->name) < 0) {
-                perror("f_write - Error creating file using touch");
-                return -1;
-            }
-            entry = get_entry_from_root(FDT[fd]->name, true, NULL);
-            if (!entry) {
-                perror("f_write - Error creating file using touch (entry still null)");
-                return -1;
-            }
-        }
-        // Get file data
-        strcat_data(data, entry->firstBlock);
-        // Append new data to file data
-        strncat(data, str, n / sizeof(char));
-    } else {
-        if (entry) {
-            // Delete old file from penn fat if it exists and recreate it
-            stored_size = entry->size;
-            if (delete_from_penn_fat(FDT[fd]->name) < 0) {
-                perror("f_write - Error deleting file cannot write properly, exiting");
-                return -1;
-            }
-        }
-        if (touch(FDT[fd]->name) < 0) {
-            perror("f_write - Error creating file using touch");
-            return -1;
+    int total = iov_total(iov, iovcnt);
+    if (total < 0) {
+        fprintf(stderr, "Error: invalid iovec array\n");
+        return -1;
+    }
+    if (total < BLOCK_SIZE) {
+        // small enough for the descriptor's write buffer
+        char* data = malloc(total > 0 ? total : 1);
+        int at = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(data + at, iov[i].iov_base, iov[i].iov_len);
+            at += iov[i].iov_len;
         }
-        // printf("f_write ls\n");
-        // f_ls(NULL);
-        // Copy str into data
-        strncpy(data, str, n / sizeof(char));
+        int written = f_write_locked(fd, data, total);
+        free(data);
+        return written;
     }
-    // Write data to file
-    entry = get_entry_from_root(FDT[fd]->name, true, NULL);
-    if (!entry) {
-        perror("f_write - Error finding file entry before append");
+    if (fdt_flush(fd) < 0) {
         return -1;
     }
-    // write(STDOUT_FILENO, "got entry\n", sizeof(char) * strlen("got entry\n"));
-    // Get first block and set it if it hasn't been set
-    int block = find_first_free_block();
-    if (block == -1) {
-        perror("File system full");
+    return fdt_writev_through(fd, iov, iovcnt, -1);
+}
+
+int f_fallocate(int fd, int len) {
+    dir_lock(false);
+    int ret = f_fallocate_locked(fd, len);
+    dir_unlock();
+    return ret;
+}
+
+int f_fallocate_locked(int fd, int len) {
+    journal_begin();
+    // Check if file descriptor is valid
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
         return -1;
     }
-    entry->firstBlock = block;
-    FAT_TABLE[block] = 0xFFFF;
-    lseek(fs_fd, block * 2, SEEK_SET);
-    write(fs_fd, &FAT_TABLE[block], 2);
-    write_entry_to_root(entry);
+    // Check if file is open for writing
+    if (FDT[fd]->mode != F_WRITE && FDT[fd]->mode != F_APPEND) {
+        perror("Error: file is not open for writing or appending");
+        return -1;
+    }
+    if (len < 0) {
+        perror("Error: invalid length");
+        return -1;
+    }
+    if (len == 0) {
+        return 0;
+    }
 
-    int chars_added = append_to_penn_fat(data, entry->firstBlock, n, stored_size);
-    // write(STDOUT_FILENO, "chars added\n", sizeof(char) * strlen("chars added\n"));
-    if (chars_added < 0) {
-        perror("f_write - Error appending to penn fat");
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
+        perror("Error: source file does not exist");
         return -1;
     }
-    FDT[fd]->offset += chars_added; // increment offset by n
-    entry->size = stored_size + chars_added;
-    write_entry_to_root(entry);
-    // write(STDOUT_FILENO, "offset\n", sizeof(char) * strlen("offset\n"));
-    free(data);
-    // printf("Data freed\n");
-    close(fs_fd);
-    return chars_added;
+
+    // walk to the last block of the range, allocating whatever is missing as extents
+    int blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    FDTEntry* fdt = FDT[fd];
+    pthread_mutex_lock(&fdt->lock);
+    pthread_rwlock_wrlock(&node->lock);
+    // the size is left alone, only the chain (and maybe firstBlock, written by chain_block_at) changes
+    int block = chain_block_at(node, fdt, blocks - 1, 1);
+    pthread_rwlock_unlock(&node->lock);
+    pthread_mutex_unlock(&fdt->lock);
+    if (block == -1) {
+        perror("f_fallocate - File system full");
+        return -1;
+    }
+    return 0;
 }
 
 // once an entry has been updated, rewrites entry to same place in root
 int write_entry_to_root(DirectoryEntry* entry) {
     // find entry
-    int* root_chain = get_fat_chain(1);
-
-    int fs_fd = open(FS_NAME, O_RDWR);
-    // printf("SIZE %i\n", entry->size);
-    // printf("NAME %s\n", entry->name);
-
-    // Iterate through all the root blocks
-    int num_entries = BLOCK_SIZE / sizeof(DirectoryEntry);
-
-    for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
-        if (!root_chain[i]) {
-            break;
-        }
-        int block_to_check = root_chain[i];
-
-        lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)), SEEK_SET);
-
-        for (int i = 0; i < num_entries; i++) {
-            // write(1, "ENTRY\n", sizeof(char) * strlen("ENTRY\n"));
-            DirectoryEntry* read_struct = calloc(1, sizeof(DirectoryEntry));
-            read(fs_fd, read_struct, sizeof(DirectoryEntry));
-            // if wanted file has been found
-            // printf("struct name %s\n", read_struct->name);
-            if (strcmp(read_struct->name, entry->name) == 0) {
-                // write(1, "FOUND\n", sizeof(char) * strlen("FOUND\n"));
-                lseek(fs_fd, TABLE_REGION_SIZE + (BLOCK_SIZE * (block_to_check - 1)) + (i * sizeof(DirectoryEntry)), SEEK_SET);
-                write(fs_fd, entry, sizeof(DirectoryEntry));
-                free(read_struct);
-                close(fs_fd);
-                return 0;
-            }
+    RootIndexNode* node = root_index_find(entry->name);
+    if (!node) {
+        return -1;
+    }
+    pthread_mutex_lock(&ALLOC_LOCK);
+    if (&node->entry != entry) {
+        if (entry_first_block(&node->entry) != entry_first_block(entry)) {
+            // open descriptors must not keep following the old chain
+            node->chain_gen = ++CHAIN_GEN;
         }
+        memcpy(&node->entry, entry, sizeof(DirectoryEntry));
     }
-    close(fs_fd);
+
+    dir_write(node->block, node->slot, entry);
+    pthread_mutex_unlock(&ALLOC_LOCK);
     return 0;
 }
 
 int f_close(int fd) {
+    dir_lock(true);
+    int ret = f_close_locked(fd);
+    dir_unlock();
+    return ret;
+}
+
+int f_close_locked(int fd) {
     // Check if file descriptor is valid
-    if (fd < 0 || fd >= NUM_FAT_ENTRIES) {
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES) {
         perror("Error: invalid file descriptor");
         return -1;
     }
@@ -1357,25 +3945,129 @@ int f_close(int fd) {
         perror("Error: file is not open");
         return -1;
     }
-    // Free FDT entry
-    free(FDT[fd]);
+    // buffered writes reach the file before the descriptor goes away
+    int ret = fdt_flush(fd);
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (node && node->open_count > 0) {
+        node->open_count--;
+    }
+    // Return the entry to the pool and the descriptor to the free stack
+    chain_reset_cursor(FDT[fd]);
+    free(FDT[fd]->wbuf);
+    pthread_mutex_destroy(&FDT[fd]->lock);
     FDT[fd] = NULL;
-    return 0;
+    FDT_FREE[NUM_FDT_FREE++] = fd;
+    return ret;
+}
+
+int f_fsync(int fd) {
+    dir_lock(false);
+    int ret = f_fsync_locked(fd);
+    dir_unlock();
+    return ret;
+}
+
+int f_fsync_locked(int fd) {
+    // Check if file descriptor is valid
+    if (fd < 0 || fd >= NUM_FDT_ENTRIES || !FDT[fd]) {
+        perror("Error: invalid file descriptor");
+        return -1;
+    }
+    if (fdt_flush(fd) < 0) {
+        return -1;
+    }
+    RootIndexNode* node = root_index_find(FDT[fd]->name);
+    if (!node) {
+        perror("Error: source file does not exist");
+        return -1;
+    }
+
+    // with a journal, committing the log writes back the dirty data blocks and then
+    // makes the FAT and directory updates durable
+    journal_sync();
+
+    // write back the file's blocks, a run of consecutive blocks at a time
+    int ret = 0;
+    int run_start = 0;
+    int run_len = 0;
+    pthread_rwlock_rdlock(&node->lock);
+    for (int block = entry_first_block(&node->entry); block != FAT_END && block != 0; block = fat_get(block)) {
+        if (!JOURNAL.active) {
+            pthread_mutex_lock(&ALLOC_LOCK);
+            if (fat_flush_entry(block) < 0) {
+                ret = -1;
+            }
+            pthread_mutex_unlock(&ALLOC_LOCK);
+        }
+        if (run_len > 0 && block == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        if (run_len > 0 && data_sync_run(run_start, run_len) < 0) {
+            ret = -1;
+        }
+        run_start = block;
+        run_len = 1;
+    }
+    if (run_len > 0 && data_sync_run(run_start, run_len) < 0) {
+        ret = -1;
+    }
+    pthread_rwlock_unlock(&node->lock);
+    if (!JOURNAL.active) {
+        // the directory block holding the file's entry
+        if (data_sync_run(node->block, 1) < 0) {
+            ret = -1;
+        }
+    }
+    if (fdatasync(FS_FD) == -1) {
+        perror("f_fsync - Error flushing image");
+        return -1;
+    }
+    return ret;
+}
+
+int f_sync() {
+    if (FS_FD == -1) {
+        perror("Error: no file system mounted");
+        return -1;
+    }
+    dir_lock(true);
+    int ret = fdt_flush_all();
+    journal_sync();
+    cache_flush();
+    if (DATA_MAP && msync(DATA_MAP, DATA_MAP_SIZE, MS_SYNC) == -1) {
+        ret = -1;
+    }
+    // journaled FAT updates are already durable in the log and reach home at the next checkpoint
+    if (!JOURNAL.active && fat_flush() < 0) {
+        ret = -1;
+    }
+    if (fdatasync(FS_FD) == -1) {
+        perror("f_sync - Error flushing image");
+        ret = -1;
+    }
+    dir_unlock();
+    return ret;
 }
 
 int f_unlink(const char *fname) {
+    dir_lock(true);
+    int ret = f_unlink_locked(fname);
+    dir_unlock();
+    return ret;
+}
+
+int f_unlink_locked(const char *fname) {
+    journal_begin();
     // Should should not be able to delete a file that is in use by another process.
     // Should not be able to delete a file that is open - check to see if it's open
-    for (int i = 0; i < NUM_FAT_ENTRIES; i++) {
-        if (FDT[i] && strcmp(FDT[i]->name, fname) == 0) {
-            perror("f_unlink - Error: file is open");
-            return -1;
-        }
+    // one index lookup answers both whether the file exists and whether it is open
+    RootIndexNode* node = root_index_find(fname);
+    if (node && node->open_count > 0) {
+        perror("f_unlink - Error: file is open");
+        return -1;
     }
-
-    // See if file currently exists by iterating through root directory
-    DirectoryEntry* entry = get_entry_from_root(fname, true, NULL);
-    if (!entry) {
+    if (!node) {
         perror("f_unlink - Error: source file does not have a directory entry");
         return -1;
     }
@@ -1383,4 +4075,249 @@ int f_unlink(const char *fname) {
     // Delete file from fat table and root directory
     delete_from_penn_fat(fname);
     return 0;
-}
\ No newline at end of file
+}
+
+pennfat_fs* pennfat_use(pennfat_fs *fs) {
+    pennfat_fs* prev = CURRENT_FS;
+    CURRENT_FS = fs ? fs : &DEFAULT_FS;
+    return prev;
+}
+
+pennfat_fs* pennfat_mount(const char *fs_name, int flags) {
+    pennfat_fs* fs = calloc(1, sizeof(pennfat_fs));
+    struct pennfat_fs_state* state = calloc(1, sizeof(struct pennfat_fs_state));
+    if (!fs || !state) {
+        perror("Error allocating file system");
+        free(fs);
+        free(state);
+        return NULL;
+    }
+    fs->fat_entry_size = 2;
+    fs->fs_fd = -1;
+    fs->state = state;
+    pthread_rwlock_init(&state->dir_lock, NULL);
+    pthread_mutex_init(&state->alloc_lock, NULL);
+    pthread_mutex_init(&state->cache_lock, NULL);
+
+    pennfat_fs* prev = pennfat_use(fs);
+    mount_with_flags(fs_name, flags);
+    bool mounted = FS_FD != -1;
+    pennfat_use(prev);
+    if (!mounted) {
+        pennfat_umount(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+void pennfat_umount(pennfat_fs *fs) {
+    if (!fs) {
+        return;
+    }
+    pennfat_fs* prev = pennfat_use(fs);
+    if (FS_FD != -1) {
+        umount();
+    }
+    pennfat_use(prev == fs ? NULL : prev);
+    if (fs == &DEFAULT_FS) {
+        return;
+    }
+    pthread_rwlock_destroy(&fs->state->dir_lock);
+    pthread_mutex_destroy(&fs->state->alloc_lock);
+    pthread_mutex_destroy(&fs->state->cache_lock);
+    free(fs->state);
+    free(fs);
+}
+
+// calls on an explicit file system: make it current for the calling thread, then restore
+int pennfat_touch(pennfat_fs *fs, const char *filename) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = touch(filename);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_mv(pennfat_fs *fs, const char *source, const char *dest) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = mv(source, dest);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_rm(pennfat_fs *fs, const char *filename) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = rm(filename);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_cat(pennfat_fs *fs, const char **files, int num_files, const char *output_file, int append) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = cat(files, num_files, output_file, append);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_cp(pennfat_fs *fs, const char *source, const char *dest, int s_host, int d_host) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = cp(source, dest, s_host, d_host);
+    pennfat_use(prev);
+    return ret;
+}
+
+void pennfat_ls(pennfat_fs *fs, const char *filename) {
+    pennfat_fs* prev = pennfat_use(fs);
+    f_ls(filename);
+    pennfat_use(prev);
+}
+
+int pennfat_defrag(pennfat_fs *fs, bool compact) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = defrag(compact);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_open(pennfat_fs *fs, char *fname, int mode) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_open(fname, mode);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_read(pennfat_fs *fs, int fd, int n, char *buf) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_read(fd, n, buf);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_write(pennfat_fs *fs, int fd, const char *str, int n) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_write(fd, str, n);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_fallocate(pennfat_fs *fs, int fd, int len) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_fallocate(fd, len);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_close(pennfat_fs *fs, int fd) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_close(fd);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_flush(pennfat_fs *fs, int fd) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_flush(fd);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_pread(pennfat_fs *fs, int fd, int n, char *buf, int offset) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_pread(fd, n, buf, offset);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_pwrite(pennfat_fs *fs, int fd, const char *str, int n, int offset) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_pwrite(fd, str, n, offset);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_readv(pennfat_fs *fs, int fd, const struct iovec *iov, int iovcnt) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_readv(fd, iov, iovcnt);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_writev(pennfat_fs *fs, int fd, const struct iovec *iov, int iovcnt) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_writev(fd, iov, iovcnt);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_fsync(pennfat_fs *fs, int fd) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_fsync(fd);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_sync(pennfat_fs *fs) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_sync();
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_unlink(pennfat_fs *fs, const char *fname) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_unlink(fname);
+    pennfat_use(prev);
+    return ret;
+}
+
+int pennfat_lseek(pennfat_fs *fs, int fd, int offset, int whence) {
+    pennfat_fs* prev = pennfat_use(fs);
+    int ret = f_lseek(fd, offset, whence);
+    pennfat_use(prev);
+    return ret;
+}
+
+// Copies between mounts a chunk at a time: each chunk is read on one file system and
+// then written on the other, so no lock of one is held while the other is used
+int pennfat_copy(pennfat_fs *src_fs, const char *source, pennfat_fs *dst_fs, const char *dest) {
+    if (src_fs == dst_fs && strcmp(source, dest) == 0) {
+        return 0;
+    }
+    int r_fd = pennfat_open(src_fs, (char *) source, F_READ);
+    if (r_fd < 0) {
+        return -1;
+    }
+    // f_open truncates (or creates) the destination
+    int w_fd = pennfat_open(dst_fs, (char *) dest, F_WRITE);
+    if (w_fd < 0) {
+        pennfat_close(src_fs, r_fd);
+        return -1;
+    }
+
+    // reserve the whole destination up front so it is laid out contiguously
+    pennfat_fs* prev = pennfat_use(src_fs);
+    dir_lock(false);
+    RootIndexNode* node = root_index_find(source);
+    int size = node ? (int) node->entry.size : 0;
+    dir_unlock();
+    pennfat_use(prev);
+    if (size > 0) {
+        pennfat_fallocate(dst_fs, w_fd, size);
+    }
+
+    int ret = 0;
+    char* buf = malloc(COPY_CHUNK);
+    int bytes_read;
+    while ((bytes_read = pennfat_read(src_fs, r_fd, COPY_CHUNK, buf)) > 0) {
+        if (pennfat_write(dst_fs, w_fd, buf, bytes_read) != bytes_read) {
+            ret = -1;
+            break;
+        }
+    }
+    if (bytes_read < 0) {
+        ret = -1;
+    }
+    free(buf);
+    pennfat_close(src_fs, r_fd);
+    pennfat_close(dst_fs, w_fd);
+    return ret;
+}
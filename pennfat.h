@@ -1,24 +1,35 @@
 #include <stdint.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 // Constants and macros
 #define MAX_FILENAME_LENGTH 32
 #define MAX_FILES 256 // Adjust as necessary for your file system
+#define FAT_END -1 // end of chain as returned by fat_get (0xFFFF or 0xFFFFFFFF on disk)
 
-extern int BLOCKS_IN_FAT, BLOCK_SIZE, FAT_SIZE, NUM_FAT_ENTRIES, TABLE_REGION_SIZE, DATA_REGION_SIZE, BLOCK_SIZE_CONFIG;
-extern uint16_t *FAT_TABLE;
-extern uint16_t *FAT_DATA;
-extern char* FS_NAME;
+extern int CACHE_BLOCKS; // number of blocks held by the block cache (set before mount)
 // uint16_t *FAT_DATA;
 
 // File Descriptor Table
 typedef struct {
     char name[MAX_FILENAME_LENGTH]; // null-terminated file name (matches with DirectoryEntry)
     int mode; // mode file is opened in
-    int offset; // offset of file pointer
+    int offset; // offset of file pointer (bytes from the start of the file)
+    int cursor_index; // logical block index of the cached chain position (-1 if none)
+    int cursor_block; // physical block at cursor_index
+    int* block_map; // logical -> physical block array, built on the first backward seek
+    int block_map_len; // number of valid entries in block_map
+    unsigned int chain_gen; // chain generation the cursor and block_map were built against
+    char* wbuf; // small writes not yet written to the image (one block, allocated on first use)
+    int wbuf_len; // bytes held in wbuf
+    int wbuf_offset; // file offset of wbuf[0]
+    int ra_next; // offset the next read starts at if reading is sequential
+    int ra_window; // readahead window in blocks (0 until reads look sequential)
+    int ra_end; // logical block index readahead has reached (exclusive)
+    pthread_mutex_t lock; // serializes threads sharing this descriptor (offset, cursor and wbuf)
 } FDTEntry;
-extern FDTEntry** FDT;
 
 // Directory entry structure
 typedef struct {
@@ -29,16 +40,60 @@ typedef struct {
                                     //  - 2: deleted entry; the file is still being used
     uint32_t size;                  // number of bytes in file
     uint16_t firstBlock;            // first block number of the file (undefined if size is zero)
+                                    //  (low 16 bits on FAT32 images)
     uint8_t type;                   // type of the file 
                                     //  0: unknown, 1: regular, 2: a directory file, 4: a symbolic link
     uint8_t perm;                   // file permissions
                                     //  0: none, 2: write-only, 4: read only,5: read and executable (shell scripts),
                                     //  6: read and write, 7: read, write, and executable
     time_t mtime;                   // creation/modification time as returned by time(2) in Linux
-    char reserved[16];              // reserved for future use or extra features
+    uint16_t firstBlockHi;          // high 16 bits of the first block on FAT32 images (0 on FAT16)
+    uint16_t tailUsed;              // bytes of the file held in tailBlock
+    uint32_t tailBlock;             // block holding the last byte of the file (0 if not known)
+    char reserved[8];               // reserved for future use or extra features
 } DirectoryEntry;
 
-extern DirectoryEntry* ROOT;
+// Per-mount state. Every mounted image has its own pennfat_fs, so one process can serve
+// several images. Calls act on the calling thread's current file system (see pennfat_use),
+// which starts out as the process-wide default that mount and umount work on.
+struct pennfat_fs_state;
+typedef struct pennfat_fs {
+    int blocks_in_fat;
+    int block_size_config;
+    int block_size;
+    int fat_size;
+    int num_fat_entries;
+    int table_region_size;
+    int64_t data_region_size;       // can exceed 2 GiB on FAT32 images
+    int fat_entry_size;             // bytes per FAT entry: 2 (FAT16) or 4 (FAT32)
+    int num_fdt_entries;            // descriptors in the file descriptor table (grows as files are opened)
+    uint16_t* fat_table;            // FAT16 entries; read FAT32 entries through fat_get/fat_set
+    char* fat_data;                 // data region mapping (NULL unless mounted with MOUNT_MMAP_DATA)
+    char* fs_name;
+    int fs_fd;                      // image descriptor owned by the mount (-1 when unmounted)
+    FDTEntry** fdt;
+    DirectoryEntry* root;
+    struct pennfat_fs_state* state; // index, allocator, journal, cache and locks (private)
+} pennfat_fs;
+
+extern __thread pennfat_fs* CURRENT_FS;
+
+// fields of the calling thread's current file system
+#define BLOCKS_IN_FAT (CURRENT_FS->blocks_in_fat)
+#define BLOCK_SIZE_CONFIG (CURRENT_FS->block_size_config)
+#define BLOCK_SIZE (CURRENT_FS->block_size)
+#define FAT_SIZE (CURRENT_FS->fat_size)
+#define NUM_FAT_ENTRIES (CURRENT_FS->num_fat_entries)
+#define TABLE_REGION_SIZE (CURRENT_FS->table_region_size)
+#define DATA_REGION_SIZE (CURRENT_FS->data_region_size)
+#define FAT_ENTRY_SIZE (CURRENT_FS->fat_entry_size)
+#define NUM_FDT_ENTRIES (CURRENT_FS->num_fdt_entries)
+#define FAT_TABLE (CURRENT_FS->fat_table)
+#define FAT_DATA (CURRENT_FS->fat_data)
+#define FS_NAME (CURRENT_FS->fs_name)
+#define FS_FD (CURRENT_FS->fs_fd)
+#define FDT (CURRENT_FS->fdt)
+#define ROOT (CURRENT_FS->root)
 
 // File modes
 #define F_WRITE  1 // Write mode
@@ -59,17 +114,50 @@ extern DirectoryEntry* ROOT;
  */
 void mkfs(char *fs_name, int blocks_in_fat, int block_size_config);
 
+// mkfs flags
+#define MKFS_FAT32 0x1 // 32-bit FAT entries and first blocks, for images past 65,534 blocks
+
+/**
+ * Initializes a new PennFAT filesystem with the given MKFS_* flags.
+ * With MKFS_FAT32 the FAT holds 32-bit entries and BLOCKS_IN_FAT may range from 1 through 65535,
+ * so an image can hold multiple GiB of data. mount detects the variant from the header.
+ * @param fs_name Name of the file system image.
+ * @param blocks_in_fat Number of blocks in the FAT region.
+ * @param block_size_config 0-4. block size will be 256, 512, 1024, 2048, or 4096 bytes depending on this value.
+ * @param flags Bitwise OR of MKFS_* flags (0 for a FAT16 image).
+ */
+void mkfs_with_flags(char *fs_name, int blocks_in_fat, int block_size_config, int flags);
+
 /**
  * Mounts the PennFAT filesystem named FS_NAME by loading its FAT into memory.
  * @param fs_name Name of the file system image to mount.
  */
 void mount(const char *fs_name);
 
+// Mount flags
+#define MOUNT_MMAP_DATA 0x1 // map the data region next to FAT_TABLE and bypass the block cache
+
+/**
+ * Mounts the PennFAT filesystem named FS_NAME with the given MOUNT_* flags.
+ * With MOUNT_MMAP_DATA the whole data region is mapped MAP_SHARED and exposed as FAT_DATA,
+ * so reads and writes copy directly to and from the image mapping.
+ * @param fs_name Name of the file system image to mount.
+ * @param flags Bitwise OR of MOUNT_* flags (0 for a cached mount).
+ */
+void mount_with_flags(const char *fs_name, int flags);
+
 /**
  * Unmounts the currently mounted PennFAT filesystem.
+ * mount and umount must not run concurrently with any other call; every other
+ * function may be called from several threads at once.
  */
 void umount();
 
+/**
+ * Writes every dirty block held in the block cache back to the image.
+ */
+void cache_flush();
+
 /**
  * Creates a file if it does not exist, or updates its timestamp to the current system time.
  * @param filename Name of the file to touch.
@@ -94,6 +182,7 @@ int rm(const char *filename);
 
 /**
  * Concatenates files and prints them to stdout, or overwrites/creates OUTPUT_FILE.
+ * Input is streamed in chunks (stdin until EOF), so files of any size can be used.
  * @param files Array of file names to concatenate.
  * @param num_files Number of files in the array.
  * @param output_file Name of the output file, NULL if output is to stdout.
@@ -130,7 +219,8 @@ int ls(const char *filename);
 int f_open(char *fname, int mode);
 
 /**
- * Reads data from a file.
+ * Reads data from a file, starting at the file pointer and advancing it by the number of bytes read.
+ * Threads reading the same or different files run in parallel.
  * @param fd File descriptor of the file to read from.
  * @param n Number of bytes to read.
  * @param buf Buffer to store read data.
@@ -139,7 +229,12 @@ int f_open(char *fname, int mode);
 int f_read(int fd, int n, char *buf);
 
 /**
- * Writes data to a file.
+ * Writes data to a file. Writes to one file are serialized and exclude its readers;
+ * writes to different files only serialize while allocating blocks.
+ * Writes smaller than a block collect in the descriptor's buffer and reach the file
+ * (size and mtime included) when the buffer fills, or on f_lseek, f_flush, f_fsync,
+ * f_close, or when the file is opened again. Errors writing buffered data are
+ * reported by the call that flushes it.
  * @param fd File descriptor of the file to write to.
  * @param str Data to write.
  * @param n Number of bytes to write.
@@ -147,6 +242,60 @@ int f_read(int fd, int n, char *buf);
  */
 int f_write(int fd, const char *str, int n);
 
+/**
+ * Reserves blocks for the first LEN bytes of an open file, allocating the missing ones
+ * as contiguous extents so later writes lay the file out sequentially.
+ * The file size is not changed (reserved blocks past EOF are used by later writes).
+ * @param fd File descriptor of a file open for writing or appending.
+ * @param len Number of bytes, from the start of the file, to reserve.
+ * @return 0 on success, negative on error (including a full file system).
+ */
+int f_fallocate(int fd, int len);
+
+/**
+ * Reads data from a file at OFFSET without using or moving the file pointer, so threads
+ * can serve different ranges of a file through one descriptor.
+ * @param fd File descriptor of the file to read from.
+ * @param n Number of bytes to read.
+ * @param buf Buffer to store read data.
+ * @param offset Byte offset within the file to read from.
+ * @return Number of bytes read, 0 if OFFSET is at or past EOF, negative on error.
+ */
+int f_pread(int fd, int n, char *buf, int offset);
+
+/**
+ * Writes data to a file at OFFSET without using or moving the file pointer. Writes
+ * buffered on the descriptor land first. On a file opened with F_APPEND the data
+ * is appended, as with pwrite(2) on O_APPEND files.
+ * @param fd File descriptor of the file to write to.
+ * @param str Data to write.
+ * @param n Number of bytes to write.
+ * @param offset Byte offset within the file to write at (a gap past EOF reads as zeros).
+ * @return Number of bytes written, negative on error.
+ */
+int f_pwrite(int fd, const char *str, int n, int offset);
+
+/**
+ * Reads from the file pointer into IOVCNT buffers in order, like readv(2), and advances
+ * the file pointer. Large requests are read with one preadv per contiguous run of blocks.
+ * @param fd File descriptor of the file to read from.
+ * @param iov Buffers to fill.
+ * @param iovcnt Number of buffers (at most IOV_MAX).
+ * @return Number of bytes read, 0 if EOF, negative on error.
+ */
+int f_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Writes IOVCNT buffers in order at the file pointer, like writev(2), and advances it.
+ * Small requests go through the descriptor's write buffer; large ones are written with
+ * one pwritev per contiguous run of blocks.
+ * @param fd File descriptor of the file to write to.
+ * @param iov Buffers to write.
+ * @param iovcnt Number of buffers (at most IOV_MAX).
+ * @return Number of bytes written, negative on error.
+ */
+int f_writev(int fd, const struct iovec *iov, int iovcnt);
+
 /**
  * Closes an open file.
  * @param fd File descriptor of the file to close.
@@ -154,6 +303,28 @@ int f_write(int fd, const char *str, int n);
  */
 int f_close(int fd);
 
+/**
+ * Writes data buffered by small f_write calls on an open file to the image.
+ * @param fd File descriptor of the file.
+ * @return 0 on success, negative on error.
+ */
+int f_flush(int fd);
+
+/**
+ * Makes an open file durable: commits queued metadata (or, without a journal, writes the
+ * FAT pages and directory block it touched), writes back its dirty blocks and flushes the image.
+ * @param fd File descriptor of the file.
+ * @return 0 on success, negative on error.
+ */
+int f_fsync(int fd);
+
+/**
+ * Makes the whole mounted file system durable: commits the journal, writes back every
+ * dirty block and dirty FAT page, and flushes the image.
+ * @return 0 on success, negative on error.
+ */
+int f_sync();
+
 /**
  * Deletes a file from the filesystem.
  * @param fname Name of the file to delete.
@@ -162,7 +333,7 @@ int f_close(int fd);
 int f_unlink(const char *fname);
 
 /**
- * Repositions the file pointer of an open file.
+ * Repositions the file pointer (a byte offset within the file) of an open file.
  * @param fd File descriptor of the file.
  * @param offset Offset for repositioning.
  * @param whence Mode of seeking (F_SEEK_SET, F_SEEK_CUR, F_SEEK_END).
@@ -176,8 +347,75 @@ int f_lseek(int fd, int offset, int whence);
  */
 void f_ls(const char *filename);
 
+/**
+ * Defragments the mounted file system: every file whose FAT chain is split into several
+ * runs is copied into one contiguous extent and its firstBlock updated.
+ * Prints the number of files and the average runs per file before and after.
+ * @param compact Also move files into the lowest free run that fits, gathering free space at the end.
+ * @return 0 on success, negative on error.
+ */
+int defrag(bool compact);
+
 void f_chmod();
 
+/**
+ * Mounts an image into a new file system handle, leaving every other mount alone.
+ * @param fs_name Name of the file system image to mount.
+ * @param flags Bitwise OR of MOUNT_* flags (0 for a cached mount).
+ * @return the new handle, NULL on error.
+ */
+pennfat_fs* pennfat_mount(const char *fs_name, int flags);
+
+/**
+ * Unmounts a handle returned by pennfat_mount and frees it.
+ * @param fs file system to unmount.
+ */
+void pennfat_umount(pennfat_fs *fs);
+
+/**
+ * Makes fs the calling thread's current file system, the one acted on by the calls that
+ * take no handle. Other threads are not affected.
+ * @param fs file system to use (NULL for the process-wide default).
+ * @return the previously current file system.
+ */
+pennfat_fs* pennfat_use(pennfat_fs *fs);
+
+/**
+ * Copies a file from one mounted file system to another (or within one).
+ * @param src_fs file system holding source.
+ * @param source name of the file to copy.
+ * @param dst_fs file system to create or overwrite dest in.
+ * @param dest name of the copy.
+ * @return 0 on success, negative on error.
+ */
+int pennfat_copy(pennfat_fs *src_fs, const char *source, pennfat_fs *dst_fs, const char *dest);
+
+/*
+ * The calls above on an explicit file system: each behaves like the call of the same name
+ * run with fs current. Descriptors belong to the file system that opened them.
+ */
+int pennfat_touch(pennfat_fs *fs, const char *filename);
+int pennfat_mv(pennfat_fs *fs, const char *source, const char *dest);
+int pennfat_rm(pennfat_fs *fs, const char *filename);
+int pennfat_cat(pennfat_fs *fs, const char **files, int num_files, const char *output_file, int append);
+int pennfat_cp(pennfat_fs *fs, const char *source, const char *dest, int s_host, int d_host);
+void pennfat_ls(pennfat_fs *fs, const char *filename);
+int pennfat_defrag(pennfat_fs *fs, bool compact);
+int pennfat_open(pennfat_fs *fs, char *fname, int mode);
+int pennfat_read(pennfat_fs *fs, int fd, int n, char *buf);
+int pennfat_write(pennfat_fs *fs, int fd, const char *str, int n);
+int pennfat_fallocate(pennfat_fs *fs, int fd, int len);
+int pennfat_close(pennfat_fs *fs, int fd);
+int pennfat_pread(pennfat_fs *fs, int fd, int n, char *buf, int offset);
+int pennfat_pwrite(pennfat_fs *fs, int fd, const char *str, int n, int offset);
+int pennfat_readv(pennfat_fs *fs, int fd, const struct iovec *iov, int iovcnt);
+int pennfat_writev(pennfat_fs *fs, int fd, const struct iovec *iov, int iovcnt);
+int pennfat_flush(pennfat_fs *fs, int fd);
+int pennfat_fsync(pennfat_fs *fs, int fd);
+int pennfat_sync(pennfat_fs *fs);
+int pennfat_unlink(pennfat_fs *fs, const char *fname);
+int pennfat_lseek(pennfat_fs *fs, int fd, int offset, int whence);
+
 // Helper functions
 /**
  * Mallocs an array of all the block numbers in the FAT chain of a file.
@@ -186,13 +424,6 @@ void f_chmod();
  */
 // int* get_fat_chain(int start_index);
 
-/**
- * Gets the data (stored as string) from a file and concatante it to data.
- * @param data String to concatenate to.
- * @param start_index Index in fat_table to begin search.
- */
-// void strcat_data(char* data, int start_index);
-
 /**
  * Gets the directory entry of a file from its name.
  * @param filename Name of the file to get the entry of.
@@ -213,10 +444,27 @@ void f_chmod();
 // DirectoryEntry* delete_entry_from_root(const char *filename);
 
 /**
- * Finds first free block that we can use. (Search fat table to find first 0)
- * @return 0 on success, negative on error.
+ * Allocates a free block using the free-block bitmap (next-fit from a roving cursor).
+ * The block is marked used and its FAT entry is set to 0xFFFF (end of chain).
+ * @return block number on success, -1 if the file system is full.
+ */
+// int alloc_block();
+
+/**
+ * Allocates a run of up to WANT contiguous blocks, starting at HINT if that block is free.
+ * The blocks are marked used and chained in order, the last one ending the chain.
+ * @param hint preferred first block (-1 for none), typically the block after a chain's tail.
+ * @param want number of blocks wanted.
+ * @param got set to the number of blocks actually allocated.
+ * @return first block of the run, -1 if the file system is full.
  */
-// int find_first_free_block();
+// int alloc_extent(int hint, int want, int* got);
+
+/**
+ * Returns a block to the free-block bitmap and clears its FAT entry.
+ * @param block block number to free.
+ */
+// void free_block(int block);
 
 /**
  * Deletes a file from PennFat Table.
@@ -226,11 +474,3 @@ void f_chmod();
  */
 // int delete_from_penn_fat(const char *filename);
 
-/**
- * Appends to a file in PennFat Table that starts at block_no (needs to have a DirectoryEntry already).
- * @param data string to append to file.
- * @param block_no block number to append to (typically entry->firstBlock)
- * @param n max number of bytes to append (will be ignored if greater than block size)
- * @return 0 on success, negative on error.
- */
-// int append_to_penn_fat(char* data, int block_no, int n);